@@ -25,6 +25,8 @@
 #ifndef DEBUGFUNCTION_H
 #define DEBUGFUNCTION_H
 
+#define DEBUGLINESIZE 256 // longest debug line formatted by MainSendDebugPrintf(), a longer one is cut
+
 void MainSendDebug(const char *payload);
 void MainSendDebugPrintf(const char* format, ...);
 void blink(int t, unsigned long speed);
@@ -26,10 +26,27 @@
 
 DomoticzMgr::DomoticzMgr(settings &configuration, P1Reader &currentP1) : conf(configuration), P1Captor(currentP1)
 {
+  Client.onData([this](void *arg, AsyncClient *client, void *data, size_t len)
+  {
+    readAnswer(static_cast<const char *>(data), len);
+  });
+
   P1Captor.OnNewDatagram([this]()
   {
-    UpdateElectricity();
-    UpdateGas();
+    Changes.Add(P1Captor.GetData());
+    if ((conf.domoInterval != 0) && (LastSend != 0) && ((millis() - LastSend) < (conf.domoInterval * 1000UL))) {
+      return; // the meter is faster than the Domoticz updates
+    }
+    LastSend = millis();
+
+    uint64_t changed = Changes.Take(conf.fullRefresh);
+    if (changed & ELECTRICITYFIELDS) {
+      UpdateElectricity();
+    }
+    uint8_t gas = P1Captor.GetData().FindMBus(MBUS_GAS);
+    if ((gas != 0) && (changed & P1Reader::FieldBit(P1Reader::MBusField(gas)))) {
+      UpdateGas();
+    }
   });
 }
 
@@ -39,8 +56,12 @@ void DomoticzMgr::UpdateGas()
   {
     return;
   }
-  char sValue[300];
-  sprintf(sValue, "%f", P1Captor.DataReaded.gasReceived5min.val());
+  uint8_t gas = P1Captor.GetData().FindMBus(MBUS_GAS);
+  if (gas == 0) {
+    return;
+  }
+  char sValue[FIXEDVALUESIZE];
+  P1Captor.GetData().mbus[gas - 1].value.toChars(sValue, sizeof(sValue));
   SendToDomoticz(conf.domoticzGasIdx, 0, sValue);
 }
 
@@ -50,32 +71,217 @@ void DomoticzMgr::UpdateElectricity()
   {
     return;
   }
-  char sValue[300];
-  sprintf(sValue, "%f;%f;%f;%f;%f;%f", P1Captor.DataReaded.electricityUsedTariff1.val(), P1Captor.DataReaded.electricityUsedTariff2.val(), P1Captor.DataReaded.electricityReturnedTariff1.val(), P1Captor.DataReaded.electricityReturnedTariff2.val(), P1Captor.DataReaded.actualElectricityPowerDeli.val(), P1Captor.DataReaded.actualElectricityPowerRet.val());
+  const P1Reader::DataP1 &data = P1Captor.GetData();
+  const P1Reader::FixedValue *values[] = {
+    &data.electricityUsedTariff1,
+    &data.electricityUsedTariff2,
+    &data.electricityReturnedTariff1,
+    &data.electricityReturnedTariff2,
+    &data.actualElectricityPowerDeli,
+    &data.actualElectricityPowerRet
+  };
+  char sValue[6 * FIXEDVALUESIZE];
+  size_t len = 0;
+
+  for (const P1Reader::FixedValue *value : values) {
+    if (len != 0) {
+      sValue[len++] = ';';
+    }
+    value->toChars(sValue + len, sizeof(sValue) - len);
+    len += strlen(sValue + len);
+  }
   SendToDomoticz(conf.domoticzEnergyIdx, 0, sValue);
 }
 
-void DomoticzMgr::SendToDomoticz(unsigned int idx, int nValue, char* sValue)
+void DomoticzMgr::SendToDomoticz(unsigned int idx, int nValue, const char *sValue)
+{
+  // Queue[0] may be already sent, its answer is waited
+  uint8_t first = (State == WAITING) ? 1 : 0;
+
+  for (uint8_t i = first; i < Stats.Depth; i++) {
+    if (Queue[i].idx == idx) {
+      Queue[i].nValue = nValue;
+      strncpy(Queue[i].sValue, sValue, sizeof(Queue[i].sValue) - 1);
+      Queue[i].sValue[sizeof(Queue[i].sValue) - 1] = '\0';
+      Stats.Coalesced++;
+      return;
+    }
+  }
+
+  if (Stats.Depth == DOMOQUEUESIZE) {
+    // the oldest update waiting is dropped
+    memmove(&Queue[first], &Queue[first + 1], sizeof(Queue[0]) * (DOMOQUEUESIZE - first - 1));
+    Stats.Depth--;
+    Stats.Dropped++;
+  }
+
+  Update &update = Queue[Stats.Depth++];
+  update.idx = idx;
+  update.nValue = nValue;
+  strncpy(update.sValue, sValue, sizeof(update.sValue) - 1);
+  update.sValue[sizeof(update.sValue) - 1] = '\0';
+}
+
+void DomoticzMgr::DoMe()
+{
+  switch (State) {
+    case IDLE:
+      if ((Stats.Depth == 0) || ((long)(millis() - NextAttempt) < 0)) {
+        return;
+      }
+      if (Client.connected()) {
+        sendRequest(true);
+        return;
+      }
+      StateSince = millis();
+      State = CONNECTING;
+      if (!Client.connect(conf.domoticzIP, conf.domoticzPort)) {
+        failed("no connection");
+      }
+      return;
+
+    case CONNECTING:
+      if (Client.connected()) {
+        Stats.ConnectLast = millis() - StateSince;
+        Stats.ConnectAvg = (Stats.Connects == 0) ? Stats.ConnectLast : (Stats.ConnectAvg * 7 + Stats.ConnectLast) / 8;
+        Stats.Connects++;
+        Client.setNoDelay(true);
+        sendRequest(false);
+      }
+      else if ((millis() - StateSince) >= DOMOTIMEOUT) {
+        Stats.Timeouts++;
+        Client.close(true);
+        failed("connection timeout");
+      }
+      else if (Client.disconnected()) {
+        failed("connection refused");
+      }
+      return;
+
+    case WAITING:
+      if (AnswerDone) {
+        answered();
+      }
+      else if (!Client.connected()) {
+        if (Reused && (AnswerLength == 0)) {
+          State = IDLE; // the kept connection was closed by Domoticz meanwhile, again on a new one
+          return;
+        }
+        failed("connection closed");
+      }
+      else if ((millis() - StateSince) >= DOMOTIMEOUT) {
+        Stats.Timeouts++;
+        Client.close(true);
+        failed("timeout");
+      }
+      return;
+  }
+}
+
+void DomoticzMgr::sendRequest(bool reused)
 {
-  WiFiClient client;
-  HTTPClient http;
-  
-  char url[255];
-  sprintf(url, "http://%s:%u/json.htm?type=command&param=udevice&idx=%u&nvalue=%d&svalue=%s", conf.domoticzIP, conf.domoticzPort, idx, nValue, sValue);
-  MainSendDebugPrintf("[DMTCZ] Send data : %s", url);
-  
-  http.begin(client, url);
-  int httpCode = http.GET();
-  
-  // httpCode will be negative on error
-  if (httpCode > 0) { 
-    // HTTP header has been sent and Server response header has been handled
-    if (httpCode == HTTP_CODE_OK) {
-      String payload = http.getString();
+  char request[320];
+  const Update &update = Queue[0];
+  int len = snprintf(request, sizeof(request),
+    "GET /json.htm?type=command&param=udevice&idx=%u&nvalue=%d&svalue=%s HTTP/1.1\r\nHost: %s:%u\r\nConnection: keep-alive\r\n\r\n",
+    update.idx, update.nValue, update.sValue, conf.domoticzIP, conf.domoticzPort);
+  MainSendDebugPrintf("[DMTCZ] Send data : idx=%u svalue=%s", update.idx, update.sValue);
+
+  LineLength = 0;
+  AnswerLength = 0;
+  HttpCode = 0;
+  ContentLength = -1;
+  BodyLeft = 0;
+  KeepAlive = true;
+  AnswerDone = false;
+  Reused = reused;
+  StateSince = millis();
+  State = WAITING;
+
+  if (Client.write(request, len) != (size_t)len) {
+    Client.close(true);
+    failed("request not sent");
+  }
+}
+
+void DomoticzMgr::readAnswer(const char *data, size_t len)
+{
+  for (size_t i = 0; (i < len) && !AnswerDone; i++) {
+    char c = data[i];
+    AnswerLength++;
+
+    // the answer must be read completely for the next request on this connection
+    if (BodyLeft > 0) {
+      BodyLeft--;
+      AnswerDone = (BodyLeft == 0);
+      continue;
+    }
+
+    // status line, then the headers until the empty line
+    if (c != '\n') {
+      if ((c != '\r') && (LineLength < (DOMOLINESIZE - 1))) {
+        Line[LineLength++] = c;
+      }
+      continue;
+    }
+    Line[LineLength] = '\0';
+
+    if (HttpCode == 0) {
+      if (sscanf(Line, "HTTP/%*s %d", &HttpCode) != 1) {
+        HttpCode = -1;
+        KeepAlive = false;
+        AnswerDone = true;
+      }
+    }
+    else if (LineLength == 0) {
+      if (ContentLength < 0) {
+        KeepAlive = false; // no length (chunked), the end can't be found
+      }
+      BodyLeft = ContentLength;
+      AnswerDone = (ContentLength <= 0);
+    }
+    else if (strncasecmp(Line, "Content-Length:", 15) == 0) {
+      ContentLength = atol(Line + 15);
+    }
+    else if ((strncasecmp(Line, "Connection:", 11) == 0) && (strstr(Line, "close") != nullptr)) {
+      KeepAlive = false;
     }
+    LineLength = 0;
   }
-  else {
-    MainSendDebugPrintf("[DMTCZ] GET failed, error: %s", http.errorToString(httpCode).c_str());
+}
+
+void DomoticzMgr::answered()
+{
+  if (HttpCode < 0) {
+    Client.close(true);
+    failed("invalid answer");
+    return;
+  }
+
+  Stats.Requests++;
+  Stats.RequestLast = millis() - StateSince;
+  Stats.RequestAvg = (Stats.Answered == 0) ? Stats.RequestLast : (Stats.RequestAvg * 7 + Stats.RequestLast) / 8;
+  Stats.Answered++;
+  if (Stats.RequestLast > Stats.RequestMax) {
+    Stats.RequestMax = Stats.RequestLast;
+  }
+  if (HttpCode != 200) {
+    MainSendDebugPrintf("[DMTCZ] GET failed, HTTP %d", HttpCode); // Domoticz refuses it, not sent again
   }
-  http.end();
-}
\ No newline at end of file
+
+  Stats.Depth--;
+  memmove(&Queue[0], &Queue[1], sizeof(Queue[0]) * Stats.Depth);
+  if (!KeepAlive) {
+    Client.close();
+  }
+  State = IDLE;
+}
+
+void DomoticzMgr::failed(const char *reason)
+{
+  Stats.Requests++;
+  Stats.Failures++;
+  MainSendDebugPrintf("[DMTCZ] GET failed (%s) on %s:%u", reason, conf.domoticzIP, conf.domoticzPort);
+  NextAttempt = millis() + DOMORETRY;
+  State = IDLE;
+}
@@ -25,8 +25,13 @@
 #ifndef DOMOMGR_H
 #define DOMOMGR_H
 
+#define DOMOTIMEOUT 2000 // ms to connect or to get the answer
+#define DOMORETRY 10000  // ms before a new attempt after a failure
+#define DOMOQUEUESIZE 4  // updates waiting, at most one per idx
+#define DOMOLINESIZE 64  // longest header line read, the rest is ignored
+
 #include <Arduino.h>
-#include <ESP8266HTTPClient.h>
+#include <ESPAsyncTCP.h>
 #include "GlobalVar.h"
 #include "P1Reader.h"
 #include "Debug.h"
@@ -35,19 +40,81 @@ class DomoticzMgr
 {
 public:
   explicit DomoticzMgr(settings &configuration, P1Reader &currentP1);
+  /// @brief Send the updates waiting, without ever waiting for Domoticz
+  void DoMe();
+
+  /// @brief Statistics of the HTTP requests to Domoticz
+  struct HttpStats
+  {
+    uint32_t Requests = 0;    // answered or failed, the retry of a closed kept connection counts once
+    uint32_t Answered = 0;    // requests with a valid answer, the samples of RequestAvg
+    uint32_t Failures = 0;    // no connection or no valid answer
+    uint32_t Timeouts = 0;    // part of the failures, Domoticz didn't answer in DOMOTIMEOUT
+    uint32_t Connects = 0;    // connections opened, the others requests reuse the previous one
+    uint32_t ConnectLast = 0; // ms
+    uint32_t ConnectAvg = 0;  // ms, moving average on 8 connections
+    uint32_t RequestLast = 0; // ms between the request and the end of the answer
+    uint32_t RequestAvg = 0;  // ms, moving average on 8 requests
+    uint32_t RequestMax = 0;  // ms
+    uint8_t Depth = 0;        // updates in Queue
+    uint32_t Coalesced = 0;   // replaced by a newer value of the same idx before being sent
+    uint32_t Dropped = 0;     // queue full
+  } Stats;
 
 private:
   settings &conf;
   P1Reader &P1Captor;
+  unsigned long LastSend = 0; // last update sent to Domoticz
+  P1ChangeTracker Changes;
+  /// @brief Values sent by UpdateElectricity()
+  static constexpr uint64_t ELECTRICITYFIELDS =
+    P1Reader::FieldBit(P1Reader::Field::electricityUsedTariff1) | P1Reader::FieldBit(P1Reader::Field::electricityUsedTariff2) |
+    P1Reader::FieldBit(P1Reader::Field::electricityReturnedTariff1) | P1Reader::FieldBit(P1Reader::Field::electricityReturnedTariff2) |
+    P1Reader::FieldBit(P1Reader::Field::actualElectricityPowerDeli) | P1Reader::FieldBit(P1Reader::Field::actualElectricityPowerRet);
+
+  /// @brief Update waiting to be sent
+  struct Update
+  {
+    unsigned int idx;
+    int nValue;
+    char sValue[6 * FIXEDVALUESIZE];
+  };
+  Update Queue[DOMOQUEUESIZE]; // oldest first, Stats.Depth used
+  AsyncClient Client; // kept open between the updates (HTTP/1.1 keep-alive)
+  enum {
+    IDLE,
+    CONNECTING,
+    WAITING       // for the answer to Queue[0]
+  } State = IDLE;
+  unsigned long StateSince = 0;   // millis()
+  unsigned long NextAttempt = 0;  // millis() of the next connection after a failure
+  bool Reused = false;            // the request was sent on a kept connection
+  // answer being read, filled by readAnswer()
+  char Line[DOMOLINESIZE];
+  uint8_t LineLength = 0;
+  size_t AnswerLength = 0;
+  int HttpCode = 0;
+  long ContentLength = -1;
+  long BodyLeft = 0;
+  bool KeepAlive = true;
+  bool AnswerDone = false;
 
   /// @brief sends the gas usage to server
   void UpdateGas();
   /// @brief sends the electricity usage to server
   void UpdateElectricity();
-  /// @brief Send to Domoticz data
+  /// @brief Queue an update for Domoticz, a newer value replaces the one waiting for the same idx
   /// @param idx
   /// @param nValue
   /// @param sValue
-  void SendToDomoticz(unsigned int idx, int nValue, char *sValue);
+  void SendToDomoticz(unsigned int idx, int nValue, const char *sValue);
+  /// @brief Send the GET of Queue[0] on the open connection
+  void sendRequest(bool reused);
+  /// @brief Parse a part of the answer, called by the network stack
+  void readAnswer(const char *data, size_t len);
+  /// @brief The whole answer to Queue[0] is read
+  void answered();
+  /// @brief No answer : Queue[0] is sent again after DOMORETRY
+  void failed(const char *reason);
 };
-#endif
\ No newline at end of file
+#endif
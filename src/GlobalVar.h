@@ -39,7 +39,14 @@
 #define LED_OFF 0x1
 
 #define SETTINGVERSIONNULL 0 //= no config
-#define SETTINGVERSION 2
+#define SETTINGVERSION 3
+#define SETTINGVERSIONV2 2 // settings up to Repport2Telnet, kept by an upgrade
+
+// Classes of MQTT topics, each one with its own QoS and retain flag (settings::mqttPolicyQos / mqttPolicyRetain)
+#define MQTTINSTANT 0     // instantaneous values, replaced by the next datagram (power, voltage, ...)
+#define MQTTCOUNTER 1     // counters and totals of the meter (energy, gas, failures, ...)
+#define MQTTSTATE 2       // state of the gateway and identity of the meter
+#define MQTTPOLICYCOUNT 3
 
 struct settings
 {
@@ -67,6 +74,16 @@ struct settings
   char adminPassword[33];
   char adminUser[33];
   bool Repport2Telnet;
+  bool ContinuousRead;       // keep Data Request on and read every datagram of the meter
+  unsigned int mqttInterval; // minimum seconds between two MQTT reports (0 = every datagram)
+  unsigned int domoInterval; // minimum seconds between two Domoticz updates (0 = every datagram)
+  unsigned int fullRefresh;  // seconds between two complete reports, only the changed values in between (0 = always complete)
+  unsigned int deadbandPower;   // W, smaller power variations are not a change
+  unsigned int deadbandVoltage; // 0.1 V, smaller voltage variations are not a change
+  bool mqttJson;             // publish the whole datagram as one JSON document instead of one topic per value
+  unsigned int mqttQos;      // QoS of the JSON document (0, 1 or 2)
+  uint8_t mqttPolicyQos[MQTTPOLICYCOUNT];  // QoS of each class of topics (MQTTINSTANT, ...)
+  bool mqttPolicyRetain[MQTTPOLICYCOUNT];  // retain flag of each class of topics
 };
 
 #ifndef LANGUAGE
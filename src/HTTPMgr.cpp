@@ -25,7 +25,7 @@
 
 #include "HTTPMgr.h"
 
-HTTPMgr::HTTPMgr(settings &currentConf, TelnetMgr &currentTelnet, MQTTMgr &currentMQTT, P1Reader &currentP1, LogP1Mgr &currentLogP1) : conf(currentConf), TelnetSrv(currentTelnet), MQTT(currentMQTT), P1Captor(currentP1), LogP1(currentLogP1), server(80)
+HTTPMgr::HTTPMgr(settings &currentConf, TelnetMgr &currentTelnet, MQTTMgr &currentMQTT, DomoticzMgr &currentDomoticz, P1Reader &currentP1, LogP1Mgr &currentLogP1) : conf(currentConf), TelnetSrv(currentTelnet), MQTT(currentMQTT), Domoticz(currentDomoticz), P1Captor(currentP1), LogP1(currentLogP1), server(80)
 {
 }
 
@@ -217,7 +217,8 @@ void HTTPMgr::ReplyOTA(bool success, const char* error, u_int ref)
 
 void HTTPMgr::handleRAW()
 {
-  server.send(200, "Text/plain", P1Captor.datagram);
+  P1Span raw = P1Captor.GetRawDatagram();
+  server.send(200, "Text/plain", raw.ptr, raw.len);
 }
 
 void HTTPMgr::handleP1Js()
@@ -281,7 +282,7 @@ void HTTPMgr::handleMainJS()
 {
   if (ActifCache(true)) return;
 
-  static char js[] PROGMEM = R"(function parseDateTime(t){return new Date("20"+t.substring(0,2),t.substring(2,4)-1,t.substring(4,6),t.substring(6,8),t.substring(8,10),t.substring(10,12))}async function updateStatus(){try{let e=await fetch("status.json"),s=await e.json();const r=document.getElementById("MQTT-indicator");null!=r&&(1==s.MQTT?r.classList.remove("error"):r.classList.add("error"));const n=document.getElementById("P1-indicator");if(""!=s.P1.LastSample){var t=parseDateTime(s.P1.LastSample);Date.now().set;t.setSeconds(t.getSeconds()+3*s.P1.Interval),t<Date.now()?n.classList.add("error"):n.classList.remove("error")}else n.classList.add("error")}catch(t){console.error("Error on update status:",t)}}window.onload=function(){updateStatus();document.querySelectorAll(".bwarning").forEach((t=>{t.addEventListener("click",(function(t){confirm(")" LANG_ASKCONFIRM R"(")||t.preventDefault()}))})),setInterval(updateStatus,1e4)};)";
+  static char js[] PROGMEM = R"(function parseDateTime(t){return"number"==typeof t?new Date(1e3*t):new Date("20"+t.substring(0,2),t.substring(2,4)-1,t.substring(4,6),t.substring(6,8),t.substring(8,10),t.substring(10,12))}async function updateStatus(){try{let e=await fetch("status.json"),s=await e.json();const r=document.getElementById("MQTT-indicator");null!=r&&(1==s.MQTT?r.classList.remove("error"):r.classList.add("error"));const n=document.getElementById("P1-indicator");if(0!=s.P1.LastSample){var t=parseDateTime(s.P1.LastSample);Date.now().set;t.setSeconds(t.getSeconds()+3*s.P1.Interval),t<Date.now()?n.classList.add("error"):n.classList.remove("error")}else n.classList.add("error")}catch(t){console.error("Error on update status:",t)}}window.onload=function(){updateStatus();document.querySelectorAll(".bwarning").forEach((t=>{t.addEventListener("click",(function(t){confirm(")" LANG_ASKCONFIRM R"(")||t.preventDefault()}))})),setInterval(updateStatus,1e4)};)";
 
   server.send(200, "application/javascript", js);
 }
@@ -493,6 +494,10 @@ static const char template_html[] PROGMEM = R"(
 <fieldset><legend>)" LANG_ConfP1H2 R"(</legend>
 <label for="interval">)" LANG_ConfReadP1Intr R"( :</label><input type="number" min="10" id="interval" name="interval" value="%u"><br />
 <label for="InvTarif">)" LANG_ConfPERMUTTARIF R"( :</label><input type="checkbox" name="InvTarif" id="InvTarif" %s><br />
+<label for="continuous">)" LANG_ConfContinuous R"( :</label><input type="checkbox" name="continuous" id="continuous" %s><br />
+<label for="fullRefresh">)" LANG_ConfFullRefresh R"( :</label><input type="number" min="0" id="fullRefresh" name="fullRefresh" value="%u"><br />
+<label for="deadbandW">)" LANG_ConfDeadbandW R"( :</label><input type="number" min="0" id="deadbandW" name="deadbandW" value="%u"><br />
+<label for="deadbandV">)" LANG_ConfDeadbandV R"( :</label><input type="number" min="0" id="deadbandV" name="deadbandV" value="%u"><br />
 </fieldset>
 <fieldset><legend>)" LANG_ConfWIFIH2 R"(</legend>
 <label for="ssid">)" LANG_ConfSSID R"( :</label><input type="text" name="ssid" id="ssid" maxlength="32" value="%s"><br />
@@ -503,7 +508,8 @@ static const char template_html[] PROGMEM = R"(
 <label for="domoticzIP">)" LANG_ConfDMTZIP R"( :</label><input type="text" name="domoticzIP" id="domoticzIP" maxlength="29" value="%s"><br />
 <label for="domoticzPort">)" LANG_ConfDMTZPORT R"( :</label><input type="number" min="1" max="65535" id="domoticzPort" name="domoticzPort" value="%u"><br />
 <label for="domoticzGasIdx">)" LANG_ConfDMTZGIdx R"( :</label><input type="number" min="0" id="domoticzGasIdx" name="domoticzGasIdx" value="%u"><br />
-<label for="domoticzEnergyIdx">)" LANG_ConfDMTZEIdx R"( :</label><input type="number" min="0" id="domoticzEnergyIdx" name="domoticzEnergyIdx" value="%u">
+<label for="domoticzEnergyIdx">)" LANG_ConfDMTZEIdx R"( :</label><input type="number" min="0" id="domoticzEnergyIdx" name="domoticzEnergyIdx" value="%u"><br />
+<label for="domoInterval">)" LANG_ConfDMTZIntr R"( :</label><input type="number" min="0" id="domoInterval" name="domoInterval" value="%u">
 </fieldset>
 <fieldset><legend>)" LANG_ConfMQTTH2 R"(</legend>
 <label for="mqtt">)" LANG_ConfMQTTBool R"( :</label><input type="checkbox" name="mqtt" id="mqtt" %s><br />
@@ -512,6 +518,12 @@ static const char template_html[] PROGMEM = R"(
 <label for="mqttUser">)" LANG_ConfMQTTUsr R"( :</label><input type="text" id="mqttUser" name="mqttUser" maxlength="31" value="%s"><br />
 <label for="mqttPass">)" LANG_ConfMQTTPSW R"( :</label><input type="password" id="mqttPass" name="mqttPass" maxlength="31" value="%s"><br />
 <label for="mqttTopic">)" LANG_ConfMQTTRoot R"( :</label><input type="text" id="mqttTopic" name="mqttTopic" maxlength="49" value="%s"><br />
+<label for="mqttInterval">)" LANG_ConfMQTTIntr R"( :</label><input type="number" min="0" id="mqttInterval" name="mqttInterval" value="%u"><br />
+<label for="mqttJson">)" LANG_ConfMQTTJson R"( :</label><input type="checkbox" name="mqttJson" id="mqttJson" %s><br />
+<label for="mqttQos">)" LANG_ConfMQTTQos R"( :</label><input type="number" min="0" max="2" id="mqttQos" name="mqttQos" value="%u"><br />
+<label for="qosInstant">)" LANG_ConfMQTTPolInstant R"( :</label><input type="number" min="0" max="2" id="qosInstant" name="qosInstant" value="%u"> <input type="checkbox" name="retainInstant" id="retainInstant" title="retain" %s><br />
+<label for="qosCounter">)" LANG_ConfMQTTPolCounter R"( :</label><input type="number" min="0" max="2" id="qosCounter" name="qosCounter" value="%u"> <input type="checkbox" name="retainCounter" id="retainCounter" title="retain" %s><br />
+<label for="qosState">)" LANG_ConfMQTTPolState R"( :</label><input type="number" min="0" max="2" id="qosState" name="qosState" value="%u"> <input type="checkbox" name="retainState" id="retainState" title="retain" %s><br />
 <label for="debugToMqtt">)" LANG_ConfMQTTDBG R"( :</label><input type="checkbox" name="debugToMqtt" id="debugToMqtt" %s><br />
 </fieldset>
 <fieldset><legend>)" LANG_ConfTLNETH2 R"(</legend>
@@ -527,6 +539,10 @@ static const char template_html[] PROGMEM = R"(
   snprintf_P(HTMLBufferContent, sizeof(HTMLBufferContent), template_html,
     conf.interval,
     (conf.InverseHigh_1_2_Tarif)? "checked" : "",
+    (conf.ContinuousRead)? "checked" : "",
+    conf.fullRefresh,
+    conf.deadbandPower,
+    conf.deadbandVoltage,
     nettoyerInputText(conf.ssid, 33),
     nettoyerInputText(conf.password, 65),
     (conf.domo)? "checked" : "",
@@ -534,12 +550,22 @@ static const char template_html[] PROGMEM = R"(
     conf.domoticzPort,
     conf.domoticzGasIdx,
     conf.domoticzEnergyIdx,
+    conf.domoInterval,
     (conf.mqtt)? "checked" : "",
     nettoyerInputText(conf.mqttIP, 30),
     conf.mqttPort,
     nettoyerInputText(conf.mqttUser, 32),
     nettoyerInputText(conf.mqttPass, 32),
     nettoyerInputText(conf.mqttTopic, 50),
+    conf.mqttInterval,
+    (conf.mqttJson)? "checked" : "",
+    conf.mqttQos,
+    conf.mqttPolicyQos[MQTTINSTANT],
+    (conf.mqttPolicyRetain[MQTTINSTANT])? "checked" : "",
+    conf.mqttPolicyQos[MQTTCOUNTER],
+    (conf.mqttPolicyRetain[MQTTCOUNTER])? "checked" : "",
+    conf.mqttPolicyQos[MQTTSTATE],
+    (conf.mqttPolicyRetain[MQTTSTATE])? "checked" : "",
     (conf.debugToMqtt)? "checked" : "",
     (conf.telnet)? "checked" : "",
     (conf.Repport2Telnet)? "checked" : "",
@@ -579,6 +605,20 @@ void HTTPMgr::handleSetupSave()
 
     NewConf.interval = server.arg("interval").toInt();
     NewConf.InverseHigh_1_2_Tarif = (server.arg("InvTarif") == "on");
+    NewConf.ContinuousRead = (server.arg("continuous") == "on");
+    NewConf.mqttInterval = server.arg("mqttInterval").toInt();
+    NewConf.mqttJson = (server.arg("mqttJson") == "on");
+    NewConf.mqttQos = constrain(server.arg("mqttQos").toInt(), 0, 2);
+    NewConf.mqttPolicyQos[MQTTINSTANT] = constrain(server.arg("qosInstant").toInt(), 0, 2);
+    NewConf.mqttPolicyQos[MQTTCOUNTER] = constrain(server.arg("qosCounter").toInt(), 0, 2);
+    NewConf.mqttPolicyQos[MQTTSTATE] = constrain(server.arg("qosState").toInt(), 0, 2);
+    NewConf.mqttPolicyRetain[MQTTINSTANT] = (server.arg("retainInstant") == "on");
+    NewConf.mqttPolicyRetain[MQTTCOUNTER] = (server.arg("retainCounter") == "on");
+    NewConf.mqttPolicyRetain[MQTTSTATE] = (server.arg("retainState") == "on");
+    NewConf.domoInterval = server.arg("domoInterval").toInt();
+    NewConf.fullRefresh = server.arg("fullRefresh").toInt();
+    NewConf.deadbandPower = server.arg("deadbandW").toInt();
+    NewConf.deadbandVoltage = server.arg("deadbandV").toInt();
     NewConf.telnet = (server.arg("telnet") == "on");
     NewConf.debugToTelnet = (server.arg("debugToTelnet") == "on");
     NewConf.Repport2Telnet = (server.arg("reportToTelnet") == "on");
@@ -642,47 +682,123 @@ void HTTPMgr::handleP1()
 
 void HTTPMgr::handleJSONStatus()
 {
-  char out[90];
   JsonDocument doc;
 
-  doc["P1"]["LastSample"] = P1Captor.DataReaded.P1timestamp;
+  doc["P1"]["LastSample"] = P1Captor.GetData().P1epoch;
   doc["P1"]["Interval"] = conf.interval;
   doc["P1"]["NextUpdateIn"] = P1Captor.GetnextUpdateTime()-millis();
+  doc["P1"]["Accepted"] = P1Captor.FramesAccepted;
+  doc["P1"]["Rejected"] = P1Captor.FramesRejected;
+  doc["P1"]["RxMax"] = P1Captor.RxHighWater;
+  doc["P1"]["RxOverrun"] = P1Captor.RxOverruns;
+  doc["P1"]["RxBytes"] = P1Captor.RxBytes;
+  doc["P1"]["PerMin"] = P1Captor.FramesPerMin;
+  doc["P1"]["BytesPerSec"] = P1Captor.BytesPerSec;
+  doc["P1"]["DecodeUs"] = P1Captor.DecodeTime;
+  doc["P1"]["LineMaxUs"] = P1Captor.LineTimeMax;
+  doc["P1"]["Predicted"] = P1Captor.TemplateHits;
+  doc["P1"]["LookedUp"] = P1Captor.TemplateMisses;
+  doc["Heap"]["Free"] = ESP.getFreeHeap(); // with the services running, the async TCP stacks need some margin
+  doc["Heap"]["MaxBlock"] = ESP.getMaxFreeBlockSize();
   if (conf.mqtt) {
     doc["MQTT"] = MQTT.IsConnected();
+    JsonArray qos = doc["MQTTQoS"].to<JsonArray>();
+    for (const MQTTMgr::QosStats &stats : MQTT.Stats) {
+      JsonObject level = qos.add<JsonObject>();
+      level["Sent"] = stats.Sent;
+      level["Acked"] = stats.Acked;
+      level["Lost"] = stats.Lost;
+      level["InFlight"] = stats.InFlight;
+      level["LatencyMs"] = stats.LatencyLast;
+      level["LatencyAvgMs"] = stats.LatencyAvg;
+      level["LatencyMaxMs"] = stats.LatencyMax;
+    }
+    doc["MQTTQueue"]["Depth"] = MQTT.Queue.Depth;
+    doc["MQTTQueue"]["DepthMax"] = MQTT.Queue.DepthMax;
+    doc["MQTTQueue"]["InFlightBytes"] = MQTT.Queue.InFlightBytes;
+    doc["MQTTQueue"]["Deferred"] = MQTT.Queue.Deferred;
+    doc["MQTTQueue"]["Coalesced"] = MQTT.Queue.Coalesced;
+    doc["MQTTQueue"]["Dropped"] = MQTT.Queue.Dropped;
+    doc["MQTTSpool"]["Depth"] = MQTT.Spool.Depth;
+    doc["MQTTSpool"]["Bytes"] = MQTT.Spool.Bytes();
+    doc["MQTTSpool"]["Dropped"] = MQTT.Spool.Dropped;
+    doc["MQTTSpool"]["Drained"] = MQTT.Spool.Drained;
+    doc["MQTTSpool"]["DrainRate"] = MQTT.Spool.DrainRate;
+    doc["MQTTDebugDropped"] = MQTT.DebugDropped;
+  }
+  if (conf.domo) {
+    doc["Domoticz"]["Requests"] = Domoticz.Stats.Requests;
+    doc["Domoticz"]["Failures"] = Domoticz.Stats.Failures;
+    doc["Domoticz"]["Timeouts"] = Domoticz.Stats.Timeouts;
+    doc["Domoticz"]["Connects"] = Domoticz.Stats.Connects;
+    doc["Domoticz"]["ConnectMs"] = Domoticz.Stats.ConnectLast;
+    doc["Domoticz"]["ConnectAvgMs"] = Domoticz.Stats.ConnectAvg;
+    doc["Domoticz"]["RequestMs"] = Domoticz.Stats.RequestLast;
+    doc["Domoticz"]["RequestAvgMs"] = Domoticz.Stats.RequestAvg;
+    doc["Domoticz"]["RequestMaxMs"] = Domoticz.Stats.RequestMax;
+    doc["Domoticz"]["Depth"] = Domoticz.Stats.Depth;
+    doc["Domoticz"]["Coalesced"] = Domoticz.Stats.Coalesced;
+    doc["Domoticz"]["Dropped"] = Domoticz.Stats.Dropped;
   }
 
-  serializeJson(doc, out);
-  
-  ActifCache(false);
-  server.send(200, "application/json", out);
+  SendJson(doc);
 }
 
 void HTTPMgr::handleJSON()
 {
-  char str[1000];
   JsonDocument doc;
-  doc["LastSample"]    = P1Captor.DataReaded.P1timestamp;
+  const P1Reader::DataP1 &data = P1Captor.GetData();
+
+  doc["LastSample"]    = data.P1epoch;
+  doc["Sequence"]      = data.sequence;
   doc["NextUpdateIn"]  = P1Captor.GetnextUpdateTime()-millis();
-  doc["P1"]["T1"]      = P1Captor.DataReaded.electricityUsedTariff1.val();
-  doc["P1"]["T2"]      = P1Captor.DataReaded.electricityUsedTariff2.val();
-  doc["P1"]["RT1"]     = P1Captor.DataReaded.electricityReturnedTariff1.val();
-  doc["P1"]["RT2"]     = P1Captor.DataReaded.electricityReturnedTariff2.val();
-  doc["P1"]["TA"]      = P1Captor.DataReaded.actualElectricityPowerDeli.val();
-  doc["P1"]["RTA"]     = P1Captor.DataReaded.actualElectricityPowerRet.val();
-  doc["P1"]["V"]["L1"] = P1Captor.DataReaded.instantaneousVoltageL1.val();
-  doc["P1"]["V"]["L2"] = P1Captor.DataReaded.instantaneousVoltageL2.val();
-  doc["P1"]["V"]["L3"] = P1Captor.DataReaded.instantaneousVoltageL3.val();
-  doc["P1"]["A"]["L1"] = P1Captor.DataReaded.instantaneousCurrentL1.val();
-  doc["P1"]["A"]["L2"] = P1Captor.DataReaded.instantaneousCurrentL2.val();
-  doc["P1"]["A"]["L3"] = P1Captor.DataReaded.instantaneousCurrentL3.val();
-  doc["P1"]["gas"]     = P1Captor.DataReaded.gasReceived5min.val();
-  doc["P1"]["water"]   = P1Captor.DataReaded.waterReceived5min.val();
-
-  serializeJson(doc, str);
+  doc["P1"]["T1"]      = data.electricityUsedTariff1;
+  doc["P1"]["T2"]      = data.electricityUsedTariff2;
+  doc["P1"]["RT1"]     = data.electricityReturnedTariff1;
+  doc["P1"]["RT2"]     = data.electricityReturnedTariff2;
+  doc["P1"]["TA"]      = data.actualElectricityPowerDeli;
+  doc["P1"]["RTA"]     = data.actualElectricityPowerRet;
+  doc["P1"]["V"]["L1"] = data.instantaneousVoltageL1;
+  doc["P1"]["V"]["L2"] = data.instantaneousVoltageL2;
+  doc["P1"]["V"]["L3"] = data.instantaneousVoltageL3;
+  doc["P1"]["A"]["L1"] = data.instantaneousCurrentL1;
+  doc["P1"]["A"]["L2"] = data.instantaneousCurrentL2;
+  doc["P1"]["A"]["L3"] = data.instantaneousCurrentL3;
+  uint8_t gas = data.FindMBus(MBUS_GAS);
+  uint8_t water = data.FindMBus(MBUS_WATER);
+  doc["P1"]["gas"]     = (gas != 0) ? data.mbus[gas - 1].value : P1Reader::FixedValue();
+  doc["P1"]["water"]   = (water != 0) ? data.mbus[water - 1].value : P1Reader::FixedValue();
+
+  JsonArray devices = doc["P1"]["MBus"].to<JsonArray>();
+  for (uint8_t i = 0; i < P1MBUSCOUNT; i++) {
+    if (data.mbus[i].IsPresent()) {
+      JsonVariant device = devices.add<JsonVariant>();
+      device.set(data.mbus[i]); // through convertToJson()
+      device["Channel"] = i + 1;
+    }
+  }
+
+  JsonArray peaks = doc["P1"]["Peaks"].to<JsonArray>();
+  for (uint8_t i = 0; i < data.peaksCount; i++) {
+    peaks.add(data.peaks[i]);
+  }
+
+  SendJson(doc); // up to 13 months of peaks, too big for the stack
+}
+
+void HTTPMgr::SendJson(const JsonDocument &doc)
+{
+  size_t length = measureJson(doc);
+  if (length >= sizeof(HTMLBufferContent)) {
+    // serializeJson() would cut it without error, the client would get an invalid document
+    MainSendDebugPrintf("[HTTP] JSON of %u bytes too big for the buffer", (unsigned int)length);
+    server.send(500, "text/plain", "JSON too big");
+    return;
+  }
+  serializeJson(doc, HTMLBufferContent, sizeof(HTMLBufferContent));
 
   ActifCache(false);
-  server.send(200, "application/json", str);
+  server.send(200, "application/json", HTMLBufferContent);
 }
 
 /// @brief Check and ask login to login
@@ -33,13 +33,14 @@
 #include "GlobalVar.h"
 #include "TelnetMgr.h"
 #include "MQTT.h"
+#include "DomoticzMgr.h"
 #include "P1Reader.h"
 #include "LogP1Mgr.h"
 
 class HTTPMgr
 {
 public:
-  explicit HTTPMgr(settings &currentConf, TelnetMgr &currentTelnet, MQTTMgr &currentMQTT, P1Reader &currentP1, LogP1Mgr &currentLogP1);
+  explicit HTTPMgr(settings &currentConf, TelnetMgr &currentTelnet, MQTTMgr &currentMQTT, DomoticzMgr &currentDomoticz, P1Reader &currentP1, LogP1Mgr &currentLogP1);
   void DoMe();
   void start_webservices();
 
@@ -47,12 +48,15 @@ private:
   settings &conf;
   TelnetMgr &TelnetSrv;
   MQTTMgr &MQTT;
+  DomoticzMgr &Domoticz;
   P1Reader &P1Captor;
   LogP1Mgr &LogP1;
   ESP8266WebServer server;
-  char HTMLBufferContent[4000];
+  char HTMLBufferContent[5400]; // the setup page with all its fields filled
   bool ChekifAsAdmin();
   void SendWithHeaderFooter(const char *content_type, char *content, const char *header, bool refresh);
+  /// @brief Send a JSON document written in HTMLBufferContent, an error if it doesn't fit
+  void SendJson(const JsonDocument &doc);
   char* nettoyerInputText(const char* inputText, size_t maxLen);
   const char* GetAnimWait();
   void handleRoot();
@@ -64,6 +64,17 @@
 #define LANG_ConfMQTTRoot "Rubrique racine MQTT"
 #define LANG_ConfReadP1Intr "Intervalle de mesure en sec"
 #define LANG_ConfPERMUTTARIF "Inverser heure creuse/pleine"
+#define LANG_ConfContinuous "Lecture continue (compteur 1 s)"
+#define LANG_ConfMQTTIntr "Intervalle d'envoi MQTT en sec (0 = chaque mesure)"
+#define LANG_ConfMQTTJson "Envoyer un seul document JSON par mesure ?"
+#define LANG_ConfMQTTQos "QoS du document JSON (0-2)"
+#define LANG_ConfMQTTPolInstant "QoS / retenu des valeurs instantanées"
+#define LANG_ConfMQTTPolCounter "QoS / retenu des compteurs"
+#define LANG_ConfMQTTPolState "QoS / retenu des états"
+#define LANG_ConfDMTZIntr "Intervalle d'envoi Domoticz en sec (0 = chaque mesure)"
+#define LANG_ConfFullRefresh "Rapport complet toutes les x sec (0 = toujours)"
+#define LANG_ConfDeadbandW "Seuil de changement puissance (W)"
+#define LANG_ConfDeadbandV "Seuil de changement tension (0,1 V)"
 #define LANG_ConfTLNETH2 "Paramètres Telnet"
 #define LANG_ConfTLNETBool "Activer le port Telnet (23)"
 #define LANG_ConfTLNETDBG "Debug via Telnet ?"
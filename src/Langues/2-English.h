@@ -64,6 +64,17 @@
 #define LANG_ConfMQTTRoot "MQTT root topic"
 #define LANG_ConfReadP1Intr "Measurement interval (sec)"
 #define LANG_ConfPERMUTTARIF "Reverse peak/off-peak"
+#define LANG_ConfContinuous "Continuous reading (1 s meters)"
+#define LANG_ConfMQTTIntr "MQTT publish interval in sec (0 = every reading)"
+#define LANG_ConfMQTTJson "Publish one JSON document per reading?"
+#define LANG_ConfMQTTQos "QoS of the JSON document (0-2)"
+#define LANG_ConfMQTTPolInstant "QoS / retain of instantaneous values"
+#define LANG_ConfMQTTPolCounter "QoS / retain of counters"
+#define LANG_ConfMQTTPolState "QoS / retain of states"
+#define LANG_ConfDMTZIntr "Domoticz update interval in sec (0 = every reading)"
+#define LANG_ConfFullRefresh "Complete report every x sec (0 = always)"
+#define LANG_ConfDeadbandW "Power change threshold (W)"
+#define LANG_ConfDeadbandV "Voltage change threshold (0.1 V)"
 #define LANG_ConfTLNETH2 "Telnet settings"
 #define LANG_ConfTLNETBool "Enable Telnet port (23)"
 #define LANG_ConfTLNETDBG "Debug via Telnet?"
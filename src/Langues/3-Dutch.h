@@ -64,6 +64,17 @@
 #define LANG_ConfMQTTRoot "MQTT-hoofdonderwerp"
 #define LANG_ConfReadP1Intr "Meetinterval in seconden"
 #define LANG_ConfPERMUTTARIF "Peak/off-peak wisselen"
+#define LANG_ConfContinuous "Continu uitlezen (meters met 1 s)"
+#define LANG_ConfMQTTIntr "MQTT publicatie-interval in seconden (0 = elke meting)"
+#define LANG_ConfMQTTJson "Eén JSON-document per meting publiceren?"
+#define LANG_ConfMQTTQos "QoS van het JSON-document (0-2)"
+#define LANG_ConfMQTTPolInstant "QoS / retain van momentane waarden"
+#define LANG_ConfMQTTPolCounter "QoS / retain van tellers"
+#define LANG_ConfMQTTPolState "QoS / retain van statussen"
+#define LANG_ConfDMTZIntr "Domoticz update-interval in seconden (0 = elke meting)"
+#define LANG_ConfFullRefresh "Volledig rapport elke x sec (0 = altijd)"
+#define LANG_ConfDeadbandW "Drempel vermogenswijziging (W)"
+#define LANG_ConfDeadbandV "Drempel spanningswijziging (0,1 V)"
 #define LANG_ConfTLNETH2 "Telnet-instellingen"
 #define LANG_ConfTLNETBool "Telnet-poort activeren (23)"
 #define LANG_ConfTLNETDBG "Debug via Telnet?"
@@ -25,6 +25,7 @@
 #define LOGP1MGR_H
 
 #define FILENAME_LAST24H "/Last24H.json"
+#define FILENAME_PEAKS "/Peaks.json"
 
 #include <LittleFS.h>
 #include <ArduinoJson.h>
@@ -60,36 +61,12 @@ public:
     //LittleFS.remove(FILENAME_LAST24H); // for debug
   }
 
-  /// @brief Converting a hex string to uint8_t
-  /// @param string Value to convert
-  /// @return an unsigned numeric value
-  static uint8_t hexStringToUint8(const char* chaine)
-  {
-    uint8_t resultat = 0;
-    int i = 0;
-
-    // The string is traversed until a non-numeric character or the end of the string is encountered.
-    while (chaine[i] >= '0' && chaine[i] <= '9') {
-      // We extract the number and multiply it by the corresponding power of 10
-      resultat = resultat * 10 + (chaine[i] - '0');
-      i++;
-    }
-
-    return resultat;
-  }
 private:
   P1Reader &DataReaderP1;
   bool FileInitied = false;
-  uint8_t LastHourInLast24H = 0;
-  struct DateTime
-  {
-    uint8_t day;
-    uint8_t month;
-    uint8_t year;
-    uint8_t hour;
-    uint8_t minute;
-    uint8_t second;
-  };
+  uint32_t LastHourInLast24H = 0; // hours since 1970 of the last point
+  bool PeaksLoaded = false;
+  uint32_t SavedPeaksHash = 0; // DataP1::peaksHash of the history in FILENAME_PEAKS
 
 
   /// @brief 
@@ -116,7 +93,6 @@ private:
   void prepareLogLast24H()
   {
     JsonDocument doc;
-    char datetime[13];
     
     FileInitied = true;
     if (!loadJSON(FILENAME_LAST24H, doc)) {
@@ -128,18 +104,61 @@ private:
       return;
     }
 
-    JsonObject lastItem = array[array.size()-1];
-    strcpy(datetime, lastItem["DateTime"]);
-    char charhour[2] = { datetime[6], datetime[7] };
-    LastHourInLast24H = hexStringToUint8(charhour);
+    JsonVariant lastDateTime = array[array.size()-1]["DateTime"];
+    uint32_t epoch;
+    if (lastDateTime.is<const char *>()) { // written by an older version
+      const char *datetime = lastDateTime.as<const char *>();
+      epoch = P1Reader::TimestampToEpoch(P1Span(datetime, strlen(datetime)));
+    }
+    else {
+      epoch = lastDateTime.as<uint32_t>();
+    }
+    LastHourInLast24H = epoch / 3600;
   }
 
 
+  /// @brief Keep the maximum demand history in a file, written only when the meter changes it
+  void savePeaks()
+  {
+    const P1Reader::DataP1 &data = DataReaderP1.GetData();
+
+    if (!PeaksLoaded) {
+      JsonDocument doc;
+      PeaksLoaded = true;
+      if (LittleFS.exists(FILENAME_PEAKS) && loadJSON(FILENAME_PEAKS, doc)) {
+        SavedPeaksHash = doc["Hash"].as<uint32_t>();
+      }
+    }
+
+    if ((data.peaksCount == 0) || (data.peaksHash == SavedPeaksHash)) {
+      return;
+    }
+
+    MainSendDebug("[STKG] Write maximum demand history");
+    JsonDocument doc;
+    doc["Hash"] = data.peaksHash;
+    JsonArray peaks = doc["Peaks"].to<JsonArray>();
+    for (uint8_t i = 0; i < data.peaksCount; i++) {
+      peaks.add(data.peaks[i]);
+    }
+
+    File file = LittleFS.open(FILENAME_PEAKS, "w");
+    serializeJson(doc, file);
+    file.close();
+    SavedPeaksHash = data.peaksHash;
+  }
+
   /// @brief Processing a new measurement received
   void newDataGram()
   {
-    char charhour[2] = { DataReaderP1.DataReaded.P1timestamp[6], DataReaderP1.DataReaded.P1timestamp[7] };
-    uint8_t hour = hexStringToUint8(charhour);
+    if (DataReaderP1.GetData().changed & P1Reader::FieldBit(P1Reader::Field::peaks)) {
+      savePeaks();
+    }
+
+    uint32_t hour = DataReaderP1.GetData().P1epoch / 3600;
+    if (hour == 0) {
+      return; // this meter doesn't give the time
+    }
     
     if (!FileInitied) {
       prepareLogLast24H();
@@ -180,19 +199,18 @@ private:
   void addPointAndSave(JsonDocument Points)
   {
     JsonObject point = Points.add<JsonObject>();
-    point["DateTime"] = DataReaderP1.DataReaded.P1timestamp;
-    point["T1"] = DataReaderP1.DataReaded.electricityUsedTariff1.val();
-    point["T2"] = DataReaderP1.DataReaded.electricityUsedTariff2.val();
-    point["R1"] = DataReaderP1.DataReaded.electricityReturnedTariff1.val();
-    point["R2"] = DataReaderP1.DataReaded.electricityReturnedTariff2.val();
+    point["DateTime"] = DataReaderP1.GetData().P1epoch;
+    point["T1"] = DataReaderP1.GetData().electricityUsedTariff1;
+    point["T2"] = DataReaderP1.GetData().electricityUsedTariff2;
+    point["R1"] = DataReaderP1.GetData().electricityReturnedTariff1;
+    point["R2"] = DataReaderP1.GetData().electricityReturnedTariff2;
 
     File file = LittleFS.open(FILENAME_LAST24H, "w");
     serializeJson(Points, file);
     file.close();
     
     //save last hour
-    char charhour[2] = { DataReaderP1.DataReaded.P1timestamp[6], DataReaderP1.DataReaded.P1timestamp[7] };
-    LastHourInLast24H = hexStringToUint8(charhour);
+    LastHourInLast24H = DataReaderP1.GetData().P1epoch / 3600;
   }
 };
 #endif
\ No newline at end of file
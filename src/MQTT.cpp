@@ -25,8 +25,91 @@
 
 #include <MQTT.h>
 
+// Names of the topics, in the order of MQTTMgr::Topic, up to Topic::mbus
+static const char TopicNames[] PROGMEM =
+  "equipmentName\0equipmentID\0reading/timestamp\0"
+  "reading/electricity_delivered_1\0reading/electricity_delivered_2\0reading/electricity_returned_1\0reading/electricity_returned_2\0"
+  "reading/electricity_currently_delivered\0reading/electricity_currently_returned\0"
+  "reading/phase_currently_delivered_l1\0reading/phase_currently_delivered_l2\0reading/phase_currently_delivered_l3\0"
+  "reading/phase_currently_returned_l1\0reading/phase_currently_returned_l2\0reading/phase_currently_returned_l3\0"
+  "reading/phase_voltage_l1\0reading/phase_voltage_l2\0reading/phase_voltage_l3\0"
+  "reading/phase_current_l1\0reading/phase_current_l2\0reading/phase_current_l3\0"
+  "consumption/gas/delivered\0consumption/water/delivered\0"
+  "meter-stats/dsmr_version\0meter-stats/electricity_tariff\0meter-stats/power_failure_count\0meter-stats/long_power_failure_count\0"
+  "meter-stats/short_power_drops\0meter-stats/short_power_peaks\0meter-stats/maximum_demand_history\0"
+  "State/status\0State/Version\0State/IP\0State/Logging\0json\0history\0command\0";
+
+// Names of the MQTTMBUSTOPICS topics of an M-Bus channel, under mbus/<channel>/
+static const char MBusTopicNames[] PROGMEM = "type\0id\0value\0timestamp\0breaker\0";
+
+// Kinds of sensor of the Home Assistant discovery, index of DiscoveryKinds
+enum DiscoveryKindId : uint8_t
+{
+  DISCOVERY_ENERGY, DISCOVERY_POWER, DISCOVERY_VOLTAGE, DISCOVERY_CURRENT, DISCOVERY_COUNTER, DISCOVERY_TEXT,
+  DISCOVERY_DIAGNOSTIC, DISCOVERY_GAS, DISCOVERY_WATER, DISCOVERY_HEAT
+};
+
+struct DiscoveryKind
+{
+  char deviceClass[8];
+  char unit[5];
+  char stateClass[17];
+};
+
+static const DiscoveryKind DiscoveryKinds[] PROGMEM = {
+  {"energy", "kWh", "total_increasing"},
+  {"power", "kW", "measurement"},
+  {"voltage", "V", "measurement"},
+  {"current", "A", "measurement"},
+  {"", "", "total_increasing"},
+  {"", "", ""},
+  {"", "", ""},
+  {"gas", "m³", "total_increasing"},
+  {"water", "m³", "total_increasing"},
+  {"energy", "GJ", "total_increasing"}
+};
+
+struct DiscoveryEntry
+{
+  MQTTMgr::Topic topic;
+  uint8_t kind; // DiscoveryKindId
+  char name[28];
+};
+
+// Sensors announced to Home Assistant, the M-Bus channels are added after them
+static const DiscoveryEntry DiscoveryEntries[] PROGMEM = {
+  {MQTTMgr::Topic::delivered1, DISCOVERY_ENERGY, "Energy delivered tariff 1"},
+  {MQTTMgr::Topic::delivered2, DISCOVERY_ENERGY, "Energy delivered tariff 2"},
+  {MQTTMgr::Topic::returned1, DISCOVERY_ENERGY, "Energy returned tariff 1"},
+  {MQTTMgr::Topic::returned2, DISCOVERY_ENERGY, "Energy returned tariff 2"},
+  {MQTTMgr::Topic::currentlyDelivered, DISCOVERY_POWER, "Power delivered"},
+  {MQTTMgr::Topic::currentlyReturned, DISCOVERY_POWER, "Power returned"},
+  {MQTTMgr::Topic::deliveredL1, DISCOVERY_POWER, "Power delivered L1"},
+  {MQTTMgr::Topic::deliveredL2, DISCOVERY_POWER, "Power delivered L2"},
+  {MQTTMgr::Topic::deliveredL3, DISCOVERY_POWER, "Power delivered L3"},
+  {MQTTMgr::Topic::returnedL1, DISCOVERY_POWER, "Power returned L1"},
+  {MQTTMgr::Topic::returnedL2, DISCOVERY_POWER, "Power returned L2"},
+  {MQTTMgr::Topic::returnedL3, DISCOVERY_POWER, "Power returned L3"},
+  {MQTTMgr::Topic::voltageL1, DISCOVERY_VOLTAGE, "Voltage L1"},
+  {MQTTMgr::Topic::voltageL2, DISCOVERY_VOLTAGE, "Voltage L2"},
+  {MQTTMgr::Topic::voltageL3, DISCOVERY_VOLTAGE, "Voltage L3"},
+  {MQTTMgr::Topic::currentL1, DISCOVERY_CURRENT, "Current L1"},
+  {MQTTMgr::Topic::currentL2, DISCOVERY_CURRENT, "Current L2"},
+  {MQTTMgr::Topic::currentL3, DISCOVERY_CURRENT, "Current L3"},
+  {MQTTMgr::Topic::tariff, DISCOVERY_TEXT, "Tariff"},
+  {MQTTMgr::Topic::powerFailures, DISCOVERY_COUNTER, "Power failures"},
+  {MQTTMgr::Topic::longPowerFailures, DISCOVERY_COUNTER, "Long power failures"},
+  {MQTTMgr::Topic::sags, DISCOVERY_COUNTER, "Voltage sags L1"},
+  {MQTTMgr::Topic::swells, DISCOVERY_COUNTER, "Voltage swells L1"},
+  {MQTTMgr::Topic::equipmentID, DISCOVERY_DIAGNOSTIC, "Equipment ID"},
+  {MQTTMgr::Topic::dsmrVersion, DISCOVERY_DIAGNOSTIC, "DSMR version"}
+};
+#define DISCOVERYFIXED (sizeof(DiscoveryEntries) / sizeof(DiscoveryEntries[0]))
+
 MQTTMgr::MQTTMgr(settings &currentConf, WifiMgr &currentLink, P1Reader &currentP1) : conf(currentConf), WifiClient(currentLink), DataReaderP1(currentP1)
 {
+  BuildTopics();
+  Spool.Load(); // published as soon as the broker is connected
   mqtt_connect();
 
   WifiClient.OnWifiEvent([this](bool b, wl_status_t s1, wl_status_t s2) {
@@ -48,12 +131,102 @@ MQTTMgr::MQTTMgr(settings &currentConf, WifiMgr &currentLink, P1Reader &currentP
   mqtt_client.onDisconnect([this](AsyncMqttClientDisconnectReason reason) {
     onMqttDisconnect(reason);
   });
+
+  mqtt_client.onPublish([this](uint16_t packetId) {
+    onMqttPublish(packetId);
+  });
+
+  mqtt_client.onMessage([this](char *topic, char *payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total) {
+    if (index == 0) {
+      onMqttMessage(topic, payload, len);
+    }
+  });
+}
+
+/// @brief Build the full name of every topic in one buffer, so a report doesn't allocate any String
+void MQTTMgr::BuildTopics()
+{
+  const uint8_t count = static_cast<uint8_t>(Topic::COUNT);
+  const uint8_t fixed = static_cast<uint8_t>(Topic::mbus);
+  const size_t root = strlen(conf.mqttTopic) + 1; // with the '/'
+  size_t size = (root * count) + sizeof(TopicNames) + P1MBUSCOUNT * (sizeof(MBusTopicNames) + MQTTMBUSTOPICS * strlen("mbus/1/"));
+
+  delete[] Topics;
+  Topics = new char[size];
+
+  uint16_t pos = 0;
+  const char *name = TopicNames;
+  for (uint8_t i = 0; i < count; i++) {
+    TopicOffset[i] = pos;
+    memcpy(&Topics[pos], conf.mqttTopic, root - 1);
+    pos += root;
+    Topics[pos - 1] = '/';
+
+    if (i < fixed) {
+      strcpy_P(&Topics[pos], name);
+      name += strlen_P(name) + 1;
+    }
+    else {
+      uint8_t attribute = (i - fixed) % MQTTMBUSTOPICS;
+      const char *mbusName = MBusTopicNames;
+      for (uint8_t a = 0; a < attribute; a++) {
+        mbusName += strlen_P(mbusName) + 1;
+      }
+      pos += sprintf(&Topics[pos], "mbus/%u/", 1 + (i - fixed) / MQTTMBUSTOPICS);
+      strcpy_P(&Topics[pos], mbusName);
+    }
+    pos += strlen(&Topics[pos]) + 1;
+  }
+}
+
+/// @brief Class of topic (MQTTINSTANT, MQTTCOUNTER or MQTTSTATE) of a value of the datagram
+static uint8_t FieldPolicy(P1Reader::Field field)
+{
+  using Field = P1Reader::Field;
+  switch (field) {
+    case Field::P1version:
+    case Field::equipmentId:
+    case Field::tariffIndicatorElectricity:
+      return MQTTSTATE;
+
+    case Field::mbus1:
+    case Field::mbus2:
+    case Field::mbus3:
+    case Field::mbus4:
+    case Field::electricityUsedTariff1:
+    case Field::electricityUsedTariff2:
+    case Field::electricityReturnedTariff1:
+    case Field::electricityReturnedTariff2:
+    case Field::numberPowerFailuresAny:
+    case Field::numberLongPowerFailuresAny:
+    case Field::longPowerFailuresLog:
+    case Field::numberVoltageSagsL1:
+    case Field::numberVoltageSagsL2:
+    case Field::numberVoltageSagsL3:
+    case Field::numberVoltageSwellsL1:
+    case Field::numberVoltageSwellsL2:
+    case Field::numberVoltageSwellsL3:
+    case Field::activeEnergyMaximumOfThisMonth:
+    case Field::peaks:
+      return MQTTCOUNTER;
+
+    default:
+      return MQTTINSTANT;
+  }
 }
 
 void MQTTMgr::onMqttDisconnect(AsyncMqttClientDisconnectReason reason)
 {
   _state = DISCONNECTED;
   CountError++;
+
+  // the acknowledgements of this connection will never come
+  for (uint8_t i = 0; i < InFlightCount; i++) {
+    Stats[InFlight[i].qos].Lost++;
+    Stats[InFlight[i].qos].InFlight--;
+  }
+  InFlightCount = 0;
+  Queue.InFlightBytes = 0;
   MainSendDebugPrintf("[MQTT] Disconnected (%u)", reason);
 
   if (CountError >= MAXERROR) {
@@ -73,9 +246,14 @@ void MQTTMgr::onMqttConnect(bool sessionPresent)
   MainSendDebug("[MQTT] connected");
 
   // Once connected, publish an announcement...
-  send_char("State/status", "running");
-  send_char("State/Version", VERSION);
-  send_char("State/IP", WifiClient.CurrentIP().c_str());
+  send_char(Topic::status, "running");
+  send_char(Topic::version, VERSION);
+  send_char(Topic::ip, WifiClient.CurrentIP().c_str());
+  mqtt_client.subscribe(TopicName(Topic::command), 1);
+
+  // the discovery configs are compared once the first datagram gives the M-Bus devices
+  DiscoveryChecked = false;
+  DiscoveryIndex = MQTTDISCOVERYIDLE;
 }
 
 bool MQTTMgr::IsConnected()
@@ -85,7 +263,7 @@ bool MQTTMgr::IsConnected()
 
 void MQTTMgr::stop()
 {
-  send_char("State/status", "stopping");
+  send_char(Topic::status, "stopping");
 }
 
 bool MQTTMgr::mqtt_connect()
@@ -102,6 +280,7 @@ bool MQTTMgr::mqtt_connect()
       mqtt_client.setCredentials(conf.mqttUser, conf.mqttPass);
     }
     mqtt_client.setServer(conf.mqttIP, conf.mqttPort);
+    mqtt_client.setWill(TopicName(Topic::status), conf.mqttPolicyQos[MQTTSTATE], true, "offline");
     mqtt_client.setClientId(GetClientName());
    
     // Attempt to connect
@@ -114,43 +293,239 @@ bool MQTTMgr::mqtt_connect()
 }
 
 
-void MQTTMgr::send_float(String name, float metric) // added *long
+void MQTTMgr::onMqttPublish(uint16_t packetId)
+{
+  for (uint8_t i = 0; i < InFlightCount; i++) {
+    if (InFlight[i].packetId == packetId) {
+      QosStats &stats = Stats[InFlight[i].qos];
+      stats.LatencyLast = millis() - InFlight[i].sentAt;
+      stats.LatencyAvg = (stats.Acked == 0) ? stats.LatencyLast : (stats.LatencyAvg * 7 + stats.LatencyLast) / 8;
+      if (stats.LatencyLast > stats.LatencyMax) {
+        stats.LatencyMax = stats.LatencyLast;
+      }
+      stats.Acked++;
+      stats.InFlight--;
+      Queue.InFlightBytes -= InFlight[i].size;
+
+      InFlight[i] = InFlight[--InFlightCount];
+      return;
+    }
+  }
+}
+
+void MQTTMgr::onMqttMessage(const char *topic, const char *payload, size_t len)
+{
+  if ((strcmp(topic, TopicName(Topic::command)) != 0) || (len >= MQTTCOMMANDSIZE)) {
+    return;
+  }
+
+  // called by the network stack, the command is run later by DoMe()
+  memcpy(Command, payload, len);
+  Command[len] = '\0';
+}
+
+void MQTTMgr::runCommand(const char *command)
+{
+  MainSendDebugPrintf("[MQTT] Command %s", command);
+
+  if (strcmp(command, "read") == 0) {
+    DataReaderP1.ResetnextUpdateTime();
+  }
+  else if (strcmp(command, "snapshot") == 0) {
+    SnapshotRequested = true;
+    MQTT_reporter();
+  }
+  else if (strncmp(command, "interval", 8) == 0) {
+    // signed, so that a negative value is refused instead of wrapping around
+    long seconds = -1;
+    long minutes = MQTTOVERRIDEMINUTES;
+    if ((sscanf(command + 8, "%ld %ld", &seconds, &minutes) < 1) || (seconds < 0) || (seconds > MQTTOVERRIDEMAXSECONDS) ||
+        (minutes < 1) || (minutes > MQTTOVERRIDEMAXMINUTES)) {
+      MainSendDebugPrintf("[MQTT] Usage : interval <0..%u seconds> [1..%u minutes]", MQTTOVERRIDEMAXSECONDS, MQTTOVERRIDEMAXMINUTES);
+      return;
+    }
+    DataReaderP1.SetIntervalOverride(static_cast<unsigned int>(seconds), static_cast<unsigned long>(minutes) * 60000UL);
+  }
+  else {
+    MainSendDebug("[MQTT] Unknown command (read, snapshot, interval <seconds> [minutes])");
+  }
+}
+
+bool MQTTMgr::publish(const char *topic, uint8_t qos, bool retain, const char *payload)
+{
+  if (qos > 2) {
+    qos = 2;
+  }
+
+  uint16_t packetId = mqtt_client.publish(topic, qos, retain, payload);
+  if (packetId == 0) {
+    return false; // not connected or no memory
+  }
+  Stats[qos].Sent++;
+
+  if (qos == 0) {
+    return true; // no acknowledgement
+  }
+
+  if (InFlightCount == MQTTINFLIGHTSIZE) {
+    // the oldest one is no longer followed
+    Stats[InFlight[0].qos].Lost++;
+    Stats[InFlight[0].qos].InFlight--;
+    Queue.InFlightBytes -= InFlight[0].size;
+    memmove(&InFlight[0], &InFlight[1], sizeof(InFlight[0]) * (MQTTINFLIGHTSIZE - 1));
+    InFlightCount--;
+  }
+  uint16_t size = strlen(topic) + strlen(payload);
+  InFlight[InFlightCount++] = {packetId, qos, size, millis()};
+  Stats[qos].InFlight++;
+  Queue.InFlightBytes += size;
+  return true;
+}
+
+bool MQTTMgr::HasBudget(size_t size) const
+{
+  return (InFlightCount < MQTTBUDGETMSGS) && ((Queue.InFlightBytes + size) <= MQTTBUDGETBYTES);
+}
+
+int8_t MQTTMgr::findPending(Topic topic) const
+{
+  for (uint8_t i = 0; i < Queue.Depth; i++) {
+    if (Pending[i].topic == topic) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+bool MQTTMgr::queuePending(Topic topic, uint8_t qos, bool retain, const char *payload)
+{
+  int8_t waiting = findPending(topic);
+  if (strlen(payload) >= MQTTPENDINGPAYLOAD) {
+    if (waiting >= 0) {
+      // the older value is stale, it must not be sent after this one
+      Queue.Depth--;
+      memmove(&Pending[waiting], &Pending[waiting + 1], sizeof(Pending[0]) * (Queue.Depth - waiting));
+      Queue.Coalesced++;
+    }
+    Queue.Dropped++; // sent again by the next report
+    return false;
+  }
+
+  if (waiting >= 0) {
+    // the older value is stale, the newer one takes its place in the queue
+    strcpy(Pending[waiting].payload, payload);
+    Pending[waiting].qos = qos;
+    Pending[waiting].retain = retain;
+    Queue.Coalesced++;
+    return true;
+  }
+
+  if (Queue.Depth == MQTTPENDINGSIZE) {
+    // the oldest value is dropped
+    memmove(&Pending[0], &Pending[1], sizeof(Pending[0]) * (MQTTPENDINGSIZE - 1));
+    Queue.Depth--;
+    Queue.Dropped++;
+  }
+
+  PendingMsg &msg = Pending[Queue.Depth++];
+  msg.topic = topic;
+  msg.qos = qos;
+  msg.retain = retain;
+  strcpy(msg.payload, payload);
+  Queue.Deferred++;
+  if (Queue.Depth > Queue.DepthMax) {
+    Queue.DepthMax = Queue.Depth;
+  }
+  return true;
+}
+
+void MQTTMgr::flushPending()
+{
+  uint8_t sent = 0;
+
+  while (sent < Queue.Depth) {
+    const PendingMsg &msg = Pending[sent];
+    const char *topic = TopicName(msg.topic);
+    if ((msg.qos != 0) && !HasBudget(strlen(topic) + strlen(msg.payload))) {
+      break; // waiting for acknowledgements
+    }
+    if (!publish(topic, msg.qos, msg.retain, msg.payload)) {
+      break;
+    }
+    sent++;
+  }
+
+  if (sent != 0) {
+    Queue.Depth -= sent;
+    memmove(&Pending[0], &Pending[sent], sizeof(Pending[0]) * Queue.Depth);
+  }
+}
+
+bool MQTTMgr::send_float(Topic topic, const P1Reader::FixedValue &metric, uint8_t policy)
+{
+  char value[FIXEDVALUESIZE];
+  metric.toChars(value, sizeof(value));
+  return send_msg(topic, value, policy); // output
+}
+
+bool MQTTMgr::send_char(Topic topic, const char *metric, uint8_t policy)
+{
+  return send_msg(topic, metric, policy);
+}
+
+void MQTTMgr::send_float(P1Reader::Field field, Topic topic, const P1Reader::FixedValue &metric)
 {
-  char value[20];
-  dtostrf(metric, 3, 3, value);
+  if ((ReportMask & P1Reader::FieldBit(field)) && !send_float(topic, metric, FieldPolicy(field))) {
+    Changes.Retry(P1Reader::FieldBit(field));
+  }
+}
 
-  String mtopic = String(conf.mqttTopic) + "/" + name;
-  send_msg(mtopic.c_str(), value); // output
+void MQTTMgr::send_char(P1Reader::Field field, Topic topic, const char *metric)
+{
+  if ((ReportMask & P1Reader::FieldBit(field)) && !send_char(topic, metric, FieldPolicy(field))) {
+    Changes.Retry(P1Reader::FieldBit(field));
+  }
 }
 
-void MQTTMgr::send_char(String name, const char *metric)
+void MQTTMgr::send_uint32_t(P1Reader::Field field, Topic topic, uint32_t metric)
 {
-  String mtopic = String(conf.mqttTopic) + "/" + name;
-  send_msg(mtopic.c_str(), metric);
+  if ((ReportMask & P1Reader::FieldBit(field)) && !send_uint32_t(topic, metric, FieldPolicy(field))) {
+    Changes.Retry(P1Reader::FieldBit(field));
+  }
 }
 
-void MQTTMgr::send_uint32_t(String name, uint32_t metric)
+bool MQTTMgr::send_uint32_t(Topic topic, uint32_t metric, uint8_t policy)
 {
   char value_buffer[11];  // uint32_t max = 4294967295 (10 chiffres + \0)
   uint32ToChar(metric, value_buffer);
-
-  String mtopic = String(conf.mqttTopic) + "/" + name;
-  send_msg(mtopic.c_str(), value_buffer);
+  return send_msg(topic, value_buffer, policy);
 }
 
 /// @brief Send a message to a broker topic
 /// @param topic 
 /// @param payload 
-void MQTTMgr::send_msg(const char *topic, const char *payload)
+/// @param policy Class of the topic, gives its QoS and retain flag
+bool MQTTMgr::send_msg(Topic topic, const char *payload, uint8_t policy)
 {
   if (!mqtt_client.connected()) {
     mqtt_connect();
   }
 
   if (payload[0] == 0) {
-    return; //nothing to report
+    return true; //nothing to report
+  }
+
+  uint8_t qos = conf.mqttPolicyQos[policy];
+  bool retain = conf.mqttPolicyRetain[policy];
+  const char *name = TopicName(topic);
+
+  // behind an older value of this topic still waiting, so that a topic never goes back to it
+  if ((findPending(topic) < 0) && ((qos == 0) || HasBudget(strlen(name) + strlen(payload)))) {
+    if (publish(name, qos, retain, payload)) {
+      return true;
+    }
   }
-  mqtt_client.publish(topic, 2, true, payload);
+  return queuePending(topic, qos, retain, payload);
 }
 
 char* MQTTMgr::uint32ToChar(uint32_t value, char* buffer)
@@ -184,59 +559,479 @@ char* MQTTMgr::uint32ToChar(uint32_t value, char* buffer)
   return buffer;
 }
 
-void MQTTMgr::SendDebug(String payload)
+void MQTTMgr::SendDebug(const char *payload)
+{
+  if (!conf.debugToMqtt || !mqtt_client.connected()) {
+    return;
+  }
+
+  // token bucket : MQTTDEBUGRATE lines per second, up to MQTTDEBUGBURST at once
+  // elapsed is clamped to a full bucket before the product, DebugRefill moves by the time of the
+  // tokens added only so that the remainder counts for the next one
+  unsigned long now = millis();
+  unsigned long elapsed = now - DebugRefill;
+  if (elapsed > (MQTTDEBUGBURST * 1000UL / MQTTDEBUGRATE)) {
+    elapsed = MQTTDEBUGBURST * 1000UL / MQTTDEBUGRATE;
+  }
+  uint32_t tokens = elapsed * MQTTDEBUGRATE / 1000;
+  if (DebugTokens + tokens >= MQTTDEBUGBURST) {
+    DebugTokens = MQTTDEBUGBURST;
+    DebugRefill = now; // full, the time spent full earns nothing
+  }
+  else if (tokens > 0) {
+    DebugTokens += tokens;
+    DebugRefill += tokens * 1000UL / MQTTDEBUGRATE;
+  }
+  if (DebugTokens == 0) {
+    DebugDropped++;
+    return;
+  }
+  DebugTokens--;
+
+  size_t len = strlen(payload);
+  if (DebugLength + len + 1 >= MQTTDEBUGSIZE) {
+    flushDebug();
+    if (len + 1 >= MQTTDEBUGSIZE) {
+      len = MQTTDEBUGSIZE - 2; // a line longer than a message is cut
+    }
+  }
+
+  if (DebugLength != 0) {
+    DebugBatch[DebugLength++] = '\n';
+  }
+  memcpy(&DebugBatch[DebugLength], payload, len);
+  DebugLength += len;
+  DebugBatch[DebugLength] = '\0';
+}
+
+void MQTTMgr::flushDebug()
+{
+  DebugFlushed = millis();
+  if (DebugDropped != DebugDroppedFlushed) {
+    char dropped[40];
+    snprintf_P(dropped, sizeof(dropped), PSTR("[MQTT] %lu debug lines dropped"), (unsigned long)(DebugDropped - DebugDroppedFlushed));
+    if (DebugLength + strlen(dropped) + 1 < MQTTDEBUGSIZE) {
+      if (DebugLength != 0) {
+        DebugBatch[DebugLength++] = '\n';
+      }
+      strcpy(&DebugBatch[DebugLength], dropped);
+      DebugLength += strlen(dropped);
+      DebugDroppedFlushed = DebugDropped;
+    }
+  }
+
+  if (DebugLength == 0) {
+    return;
+  }
+
+  // QoS 0 and not retained : the log is only for who is listening
+  if (!publish(TopicName(Topic::logging), 0, false, DebugBatch)) {
+    DebugDropped++;
+  }
+  DebugLength = 0;
+}
+
+void MQTTMgr::send_json(const P1Reader::DataP1 &data)
+{
+  MainSendDebug("[MQTT] Send P1 data as JSON");
+
+  // same names as the topics of the other mode, so a value_template is value_json.<topic name>
+  JsonDocument doc;
+  doc["equipmentName"] = DataReaderP1.meterName;
+  doc["equipmentID"] = data.equipmentId;
+  doc["dsmr_version"] = data.P1version;
+  doc["timestamp"] = data.P1timestamp;
+  doc["epoch"] = data.P1epoch;
+  doc["sequence"] = data.sequence;
+
+  doc["electricity_delivered_1"] = data.electricityUsedTariff1;
+  doc["electricity_delivered_2"] = data.electricityUsedTariff2;
+  doc["electricity_returned_1"] = data.electricityReturnedTariff1;
+  doc["electricity_returned_2"] = data.electricityReturnedTariff2;
+  doc["electricity_currently_delivered"] = data.actualElectricityPowerDeli;
+  doc["electricity_currently_returned"] = data.actualElectricityPowerRet;
+  doc["electricity_tariff"] = data.tariffIndicatorElectricity;
+
+  doc["phase_currently_delivered_l1"] = data.activePowerL1P;
+  doc["phase_currently_delivered_l2"] = data.activePowerL2P;
+  doc["phase_currently_delivered_l3"] = data.activePowerL3P;
+  doc["phase_currently_returned_l1"] = data.activePowerL1NP;
+  doc["phase_currently_returned_l2"] = data.activePowerL2NP;
+  doc["phase_currently_returned_l3"] = data.activePowerL3NP;
+  doc["phase_voltage_l1"] = data.instantaneousVoltageL1;
+  doc["phase_voltage_l2"] = data.instantaneousVoltageL2;
+  doc["phase_voltage_l3"] = data.instantaneousVoltageL3;
+  doc["phase_current_l1"] = data.instantaneousCurrentL1;
+  doc["phase_current_l2"] = data.instantaneousCurrentL2;
+  doc["phase_current_l3"] = data.instantaneousCurrentL3;
+
+  doc["power_failure_count"] = data.numberPowerFailuresAny;
+  doc["long_power_failure_count"] = data.numberLongPowerFailuresAny;
+  doc["short_power_drops"] = data.numberVoltageSagsL1;
+  doc["short_power_peaks"] = data.numberVoltageSwellsL1;
+
+  uint8_t gas = data.FindMBus(MBUS_GAS);
+  if (gas != 0) {
+    doc["gas_delivered"] = data.mbus[gas - 1].value;
+  }
+  uint8_t water = data.FindMBus(MBUS_WATER);
+  if (water != 0) {
+    doc["water_delivered"] = data.mbus[water - 1].value;
+  }
+
+  JsonArray mbus = doc["mbus"].to<JsonArray>();
+  for (uint8_t channel = 1; channel <= P1MBUSCOUNT; channel++) {
+    if (data.mbus[channel - 1].IsPresent()) {
+      mbus.add(data.mbus[channel - 1]);
+    }
+  }
+
+  JsonArray peaks = doc["maximum_demand_history"].to<JsonArray>();
+  for (uint8_t i = 0; i < data.peaksCount; i++) {
+    peaks.add(data.peaks[i]);
+  }
+
+  String payload;
+  serializeJson(doc, payload);
+
+  if (!mqtt_client.connected()) {
+    mqtt_connect();
+  }
+  if ((conf.mqttQos != 0) && !HasBudget(strlen(TopicName(Topic::json)) + payload.length())) {
+    Queue.Dropped++; // the broker is slow, the next document replaces this one
+    return;
+  }
+  publish(TopicName(Topic::json), conf.mqttQos, true, payload.c_str());
+}
+
+void MQTTMgr::DoMe()
+{
+  if (!mqtt_client.connected()) {
+    return;
+  }
+
+  if (Command[0] != '\0') {
+    char command[MQTTCOMMANDSIZE];
+    strcpy(command, Command);
+    Command[0] = '\0';
+    runCommand(command);
+  }
+
+  if (Queue.Depth != 0) {
+    flushPending();
+  }
+
+  if ((DebugLength != 0) && ((millis() - DebugFlushed) >= MQTTDEBUGPERIOD)) {
+    flushDebug();
+  }
+
+  if (DataReaderP1.dataEnd && (DiscoveryIndex == MQTTDISCOVERYIDLE)) {
+    uint8_t mbus = 0;
+    for (uint8_t channel = 1; channel <= P1MBUSCOUNT; channel++) {
+      mbus |= DataReaderP1.GetData().mbus[channel - 1].IsPresent() << (channel - 1);
+    }
+    if (!DiscoveryChecked || (mbus != DiscoveryMBus)) {
+      DiscoveryChecked = true;
+      DiscoveryMBus = mbus;
+      startDiscovery();
+    }
+  }
+
+  if (DiscoveryIndex != MQTTDISCOVERYIDLE) {
+    publishDiscovery();
+  }
+
+  if ((Spool.Depth != 0) && ((millis() - LastDrain) >= MQTTSPOOLDRAINPERIOD)) {
+    LastDrain = millis();
+    drainSpool();
+  }
+}
+
+bool MQTTMgr::discoveryConfig(uint8_t index, char *topic, size_t topicSize, char *payload, size_t payloadSize)
+{
+  DiscoveryEntry entry;
+  const char *key = nullptr; // of the value in the JSON document
+
+  if (index < DISCOVERYFIXED) {
+    memcpy_P(&entry, &DiscoveryEntries[index], sizeof(entry));
+  }
+  else {
+    uint8_t channel = index - DISCOVERYFIXED + 1;
+    const P1Reader::MBusP1 &device = DataReaderP1.GetData().mbus[channel - 1];
+    if (!device.IsPresent()) {
+      return false;
+    }
+
+    entry.topic = MBusTopic(channel, 2);
+    switch (device.type) {
+      case MBUS_GAS:
+        entry.kind = DISCOVERY_GAS;
+        key = "gas_delivered";
+        snprintf_P(entry.name, sizeof(entry.name), PSTR("Gas"));
+        break;
+      case MBUS_WATER:
+        entry.kind = DISCOVERY_WATER;
+        key = "water_delivered";
+        snprintf_P(entry.name, sizeof(entry.name), PSTR("Water"));
+        break;
+      case MBUS_HEAT:
+        entry.kind = DISCOVERY_HEAT;
+        snprintf_P(entry.name, sizeof(entry.name), PSTR("Heat"));
+        break;
+      default:
+        entry.kind = DISCOVERY_COUNTER;
+        snprintf_P(entry.name, sizeof(entry.name), PSTR("M-Bus %u"), channel);
+        break;
+    }
+  }
+
+  const char *object = TopicName(entry.topic) + strlen(conf.mqttTopic) + 1; // reading/phase_voltage_l1
+  if (key == nullptr) {
+    const char *last = strrchr(object, '/');
+    key = (last != nullptr) ? last + 1 : object;
+  }
+  if (conf.mqttJson && (index >= DISCOVERYFIXED) && (entry.kind != DISCOVERY_GAS) && (entry.kind != DISCOVERY_WATER)) {
+    return false; // only gas and water have their own key in the JSON document
+  }
+
+  char objectId[48];
+  strncpy(objectId, object, sizeof(objectId) - 1);
+  objectId[sizeof(objectId) - 1] = '\0';
+  for (char *c = objectId; *c != '\0'; c++) {
+    if (*c == '/') {
+      *c = '_';
+    }
+  }
+
+  DiscoveryKind kind;
+  memcpy_P(&kind, &DiscoveryKinds[entry.kind], sizeof(kind));
+
+  snprintf_P(topic, topicSize, PSTR(MQTTDISCOVERYPREFIX "/sensor/%s/%s/config"), GetClientName(), objectId);
+
+  size_t len = snprintf_P(payload, payloadSize, PSTR("{\"name\":\"%s\",\"uniq_id\":\"%s_%s\",\"stat_t\":\"%s\""),
+    entry.name, GetClientName(), objectId, TopicName(conf.mqttJson ? Topic::json : entry.topic));
+  if (conf.mqttJson && (len < payloadSize)) {
+    len += snprintf_P(&payload[len], payloadSize - len, PSTR(",\"val_tpl\":\"{{ value_json.%s }}\""), key);
+  }
+  if ((kind.deviceClass[0] != '\0') && (len < payloadSize)) {
+    len += snprintf_P(&payload[len], payloadSize - len, PSTR(",\"dev_cla\":\"%s\""), kind.deviceClass);
+  }
+  if ((kind.unit[0] != '\0') && (len < payloadSize)) {
+    len += snprintf_P(&payload[len], payloadSize - len, PSTR(",\"unit_of_meas\":\"%s\""), kind.unit);
+  }
+  if ((kind.stateClass[0] != '\0') && (len < payloadSize)) {
+    len += snprintf_P(&payload[len], payloadSize - len, PSTR(",\"stat_cla\":\"%s\""), kind.stateClass);
+  }
+  if ((entry.kind == DISCOVERY_DIAGNOSTIC) && (len < payloadSize)) {
+    len += snprintf_P(&payload[len], payloadSize - len, PSTR(",\"ent_cat\":\"diagnostic\""));
+  }
+  if (len < payloadSize) {
+    len += snprintf_P(&payload[len], payloadSize - len,
+      PSTR(",\"avty_t\":\"%s\",\"avty_tpl\":\"{{ 'online' if value == 'running' else 'offline' }}\","
+        "\"dev\":{\"ids\":[\"%s\"],\"name\":\"%s\",\"mf\":\"P1 wifi gateway\",\"mdl\":\"%s\",\"sw\":\"" VERSION "\"}}"),
+      TopicName(Topic::status), GetClientName(), GetClientName(), DataReaderP1.meterName.c_str());
+  }
+
+  return len < payloadSize;
+}
+
+void MQTTMgr::startDiscovery()
+{
+  char topic[128];
+  char payload[768];
+  uint32_t hash = 2166136261UL; // FNV-1a of all the configs
+
+  for (uint8_t i = 0; i < DISCOVERYFIXED + P1MBUSCOUNT; i++) {
+    if (discoveryConfig(i, topic, sizeof(topic), payload, sizeof(payload))) {
+      for (const char *c = topic; *c != '\0'; c++) {
+        hash = (hash ^ static_cast<uint8_t>(*c)) * 16777619UL;
+      }
+      for (const char *c = payload; *c != '\0'; c++) {
+        hash = (hash ^ static_cast<uint8_t>(*c)) * 16777619UL;
+      }
+    }
+  }
+
+  if (hash == DiscoveryHash) {
+    return; // the broker keeps them (retained)
+  }
+
+  MainSendDebug("[MQTT] Publish Home Assistant discovery");
+  DiscoveryPending = hash;
+  DiscoveryIndex = 0;
+}
+
+void MQTTMgr::publishDiscovery()
+{
+  char topic[128];
+  char payload[768];
+  uint8_t sent = 0;
+
+  while ((DiscoveryIndex < DISCOVERYFIXED + P1MBUSCOUNT) && (sent < MQTTDISCOVERYBATCH)) {
+    if ((Queue.Depth != 0) || (InFlightCount >= (MQTTBUDGETMSGS / 2))) {
+      return; // the live values first
+    }
+
+    if (discoveryConfig(DiscoveryIndex, topic, sizeof(topic), payload, sizeof(payload))) {
+      if (!HasBudget(strlen(topic) + strlen(payload)) || !publish(topic, 1, true, payload)) {
+        return; // again at the next DoMe()
+      }
+      sent++;
+    }
+    DiscoveryIndex++;
+  }
+
+  if (DiscoveryIndex >= DISCOVERYFIXED + P1MBUSCOUNT) {
+    DiscoveryHash = DiscoveryPending;
+    DiscoveryIndex = MQTTDISCOVERYIDLE;
+  }
+}
+
+void MQTTMgr::drainSpool()
 {
-  if (conf.debugToMqtt && mqtt_client.connected()) {
-    char charArray[payload.length() + 1]; // +1 for the null character
-    payload.toCharArray(charArray, sizeof(charArray));
-    charArray[sizeof(charArray) - 1] = '\0';
-    send_char("State/Logging", charArray);
+  if ((Queue.Depth != 0) || (InFlightCount >= (MQTTBUDGETMSGS / 2))) {
+    return; // the broker is slow, the live values first
+  }
+
+  MQTTSpool::Record records[MQTTSPOOLBATCH];
+  uint8_t count = Spool.Read(records, MQTTSPOOLBATCH);
+  uint8_t sent = 0;
+
+  for (; sent < count; sent++) {
+    const MQTTSpool::Record &record = records[sent];
+    char values[7][FIXEDVALUESIZE];
+    char payload[384];
+
+    snprintf(payload, sizeof(payload), "{\"epoch\":%lu,\"electricity_delivered_1\":%s,\"electricity_delivered_2\":%s,"
+      "\"electricity_returned_1\":%s,\"electricity_returned_2\":%s,\"electricity_currently_delivered\":%s,"
+      "\"electricity_currently_returned\":%s,\"gas_delivered\":%s,\"gas_epoch\":%lu}",
+      (unsigned long)record.epoch,
+      record.electricityUsedTariff1.toChars(values[0], FIXEDVALUESIZE),
+      record.electricityUsedTariff2.toChars(values[1], FIXEDVALUESIZE),
+      record.electricityReturnedTariff1.toChars(values[2], FIXEDVALUESIZE),
+      record.electricityReturnedTariff2.toChars(values[3], FIXEDVALUESIZE),
+      record.actualElectricityPowerDeli.toChars(values[4], FIXEDVALUESIZE),
+      record.actualElectricityPowerRet.toChars(values[5], FIXEDVALUESIZE),
+      record.gas.toChars(values[6], FIXEDVALUESIZE),
+      (unsigned long)record.gasEpoch);
+
+    // not retained : an old reading must not replace the last one for a new subscriber
+    uint8_t qos = conf.mqttPolicyQos[MQTTCOUNTER];
+    if ((qos != 0) && !HasBudget(strlen(TopicName(Topic::history)) + strlen(payload))) {
+      break;
+    }
+    if (!publish(TopicName(Topic::history), qos, false, payload)) {
+      break;
+    }
   }
+
+  Spool.Consume(sent);
 }
 
 void MQTTMgr::MQTT_reporter()
 {
+  using Field = P1Reader::Field;
+  const P1Reader::DataP1 &data = DataReaderP1.GetData();
   if (!DataReaderP1.dataEnd) {
     //No valid data to send
     return;
   }
 
+  if (!mqtt_client.connected()) {
+    Spool.Append(data); // published on history once the broker is back
+  }
+
+  Changes.Add(data);
+  unsigned int interval = DataReaderP1.GetIntervalOverride(); // someone is watching
+  if (interval == 0) {
+    interval = conf.mqttInterval;
+  }
+  if (!SnapshotRequested && (interval != 0) && (LastReportinMillis != 0) && ((millis() - LastReportinMillis) < (interval * 1000UL))) {
+    return; // the meter is faster than the MQTT reports
+  }
+
+  LastReportinMillis = millis();
+  ReportMask = Changes.Take(conf.fullRefresh);
+  if (SnapshotRequested) {
+    ReportMask = P1Reader::ALLFIELDS;
+    SnapshotRequested = false;
+  }
+  if (ReportMask == 0) {
+    return; // nothing changed since the last report
+  }
+
+  if (conf.mqttJson) {
+    send_json(data);
+    return;
+  }
+
   MainSendDebug("[MQTT] Send P1 data");
 
   //no DSMR valid :
-  send_char("equipmentName", DataReaderP1.meterName.c_str());
-
-  send_char("equipmentID", DataReaderP1.DataReaded.equipmentId);
-  send_char("reading/timestamp", DataReaderP1.DataReaded.P1timestamp);
-
-  send_float("reading/electricity_delivered_1", DataReaderP1.DataReaded.electricityUsedTariff1);
-  send_float("reading/electricity_delivered_2", DataReaderP1.DataReaded.electricityUsedTariff2);
-  send_float("reading/electricity_returned_1", DataReaderP1.DataReaded.electricityReturnedTariff1);
-  send_float("reading/electricity_returned_2", DataReaderP1.DataReaded.electricityReturnedTariff2);
-  send_float("reading/electricity_currently_delivered", DataReaderP1.DataReaded.actualElectricityPowerDeli);
-  send_float("reading/electricity_currently_returned", DataReaderP1.DataReaded.actualElectricityPowerRet);
-
-  send_float("reading/phase_currently_delivered_l1", DataReaderP1.DataReaded.activePowerL1P);
-  send_float("reading/phase_currently_delivered_l2", DataReaderP1.DataReaded.activePowerL2P);
-  send_float("reading/phase_currently_delivered_l3", DataReaderP1.DataReaded.activePowerL3P);
-  send_float("reading/phase_currently_returned_l1", DataReaderP1.DataReaded.activePowerL1NP);
-  send_float("reading/phase_currently_returned_l2", DataReaderP1.DataReaded.activePowerL2NP);
-  send_float("reading/phase_currently_returned_l3", DataReaderP1.DataReaded.activePowerL3NP);
-  send_float("reading/phase_voltage_l1", DataReaderP1.DataReaded.instantaneousVoltageL1);
-  send_float("reading/phase_voltage_l2", DataReaderP1.DataReaded.instantaneousVoltageL2);
-  send_float("reading/phase_voltage_l3", DataReaderP1.DataReaded.instantaneousVoltageL3);
-
-  send_float("consumption/gas/delivered", DataReaderP1.DataReaded.gasReceived5min);
-  send_float("consumption/water/delivered", DataReaderP1.DataReaded.waterReceived5min);
-
-  send_char("meter-stats/dsmr_version", DataReaderP1.DataReaded.P1version);
-  send_uint32_t("meter-stats/electricity_tariff", DataReaderP1.DataReaded.tariffIndicatorElectricity);
-  send_uint32_t("meter-stats/power_failure_count", DataReaderP1.DataReaded.numberLongPowerFailuresAny);
-  send_uint32_t("meter-stats/long_power_failure_count", DataReaderP1.DataReaded.numberLongPowerFailuresAny);
-  send_uint32_t("meter-stats/short_power_drops", DataReaderP1.DataReaded.numberVoltageSagsL1);
-  send_uint32_t("meter-stats/short_power_peaks", DataReaderP1.DataReaded.numberVoltageSwellsL1);
+  send_char(Field::equipmentId, Topic::equipmentName, DataReaderP1.meterName.c_str());
 
-  LastReportinMillis = millis();
+  send_char(Field::equipmentId, Topic::equipmentID, data.equipmentId);
+  send_char(Field::P1timestamp, Topic::timestamp, data.P1timestamp);
+
+  send_float(Field::electricityUsedTariff1, Topic::delivered1, data.electricityUsedTariff1);
+  send_float(Field::electricityUsedTariff2, Topic::delivered2, data.electricityUsedTariff2);
+  send_float(Field::electricityReturnedTariff1, Topic::returned1, data.electricityReturnedTariff1);
+  send_float(Field::electricityReturnedTariff2, Topic::returned2, data.electricityReturnedTariff2);
+  send_float(Field::actualElectricityPowerDeli, Topic::currentlyDelivered, data.actualElectricityPowerDeli);
+  send_float(Field::actualElectricityPowerRet, Topic::currentlyReturned, data.actualElectricityPowerRet);
+
+  send_float(Field::activePowerL1P, Topic::deliveredL1, data.activePowerL1P);
+  send_float(Field::activePowerL2P, Topic::deliveredL2, data.activePowerL2P);
+  send_float(Field::activePowerL3P, Topic::deliveredL3, data.activePowerL3P);
+  send_float(Field::activePowerL1NP, Topic::returnedL1, data.activePowerL1NP);
+  send_float(Field::activePowerL2NP, Topic::returnedL2, data.activePowerL2NP);
+  send_float(Field::activePowerL3NP, Topic::returnedL3, data.activePowerL3NP);
+  send_float(Field::instantaneousVoltageL1, Topic::voltageL1, data.instantaneousVoltageL1);
+  send_float(Field::instantaneousVoltageL2, Topic::voltageL2, data.instantaneousVoltageL2);
+  send_float(Field::instantaneousVoltageL3, Topic::voltageL3, data.instantaneousVoltageL3);
+  send_float(Field::instantaneousCurrentL1, Topic::currentL1, data.instantaneousCurrentL1);
+  send_float(Field::instantaneousCurrentL2, Topic::currentL2, data.instantaneousCurrentL2);
+  send_float(Field::instantaneousCurrentL3, Topic::currentL3, data.instantaneousCurrentL3);
+
+  uint8_t gas = data.FindMBus(MBUS_GAS);
+  if (gas != 0) {
+    send_float(P1Reader::MBusField(gas), Topic::gas, data.mbus[gas - 1].value);
+  }
+  uint8_t water = data.FindMBus(MBUS_WATER);
+  if (water != 0) {
+    send_float(P1Reader::MBusField(water), Topic::water, data.mbus[water - 1].value);
+  }
+
+  for (uint8_t channel = 1; channel <= P1MBUSCOUNT; channel++) {
+    const P1Reader::MBusP1 &device = data.mbus[channel - 1];
+    if (device.IsPresent()) {
+      Field field = P1Reader::MBusField(channel);
+      send_uint32_t(field, MBusTopic(channel, 0), device.type);
+      send_char(field, MBusTopic(channel, 1), device.id);
+      send_float(field, MBusTopic(channel, 2), device.value);
+      send_uint32_t(field, MBusTopic(channel, 3), device.epoch);
+      send_uint32_t(field, MBusTopic(channel, 4), device.breaker);
+    }
+  }
+
+  send_char(Field::P1version, Topic::dsmrVersion, data.P1version);
+  send_uint32_t(Field::tariffIndicatorElectricity, Topic::tariff, data.tariffIndicatorElectricity);
+  send_uint32_t(Field::numberPowerFailuresAny, Topic::powerFailures, data.numberPowerFailuresAny);
+  send_uint32_t(Field::numberLongPowerFailuresAny, Topic::longPowerFailures, data.numberLongPowerFailuresAny);
+  send_uint32_t(Field::numberVoltageSagsL1, Topic::sags, data.numberVoltageSagsL1);
+  send_uint32_t(Field::numberVoltageSwellsL1, Topic::swells, data.numberVoltageSwellsL1);
+
+  if ((ReportMask & P1Reader::FieldBit(Field::peaks)) && (data.peaksCount > 0)) {
+    // same JSON as convertToJson(PeakP1), written without a JsonDocument
+    char payload[P1PEAKSCOUNT * 40];
+    size_t len = 0;
+    payload[len++] = '[';
+    for (uint8_t i = 0; i < data.peaksCount; i++) {
+      len += snprintf(&payload[len], sizeof(payload) - len, "%s{\"Epoch\":%lu,\"mW\":%lu}", (i == 0) ? "" : ",", (unsigned long)data.peaks[i].epoch, (unsigned long)data.peaks[i].peak_mW);
+    }
+    snprintf(&payload[len], sizeof(payload) - len, "]");
+    send_char(Field::peaks, Topic::peaks, payload); // too long for Pending, sent again by the next report if it can't go now
+  }
 
   return;
 }
\ No newline at end of file
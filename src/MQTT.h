@@ -28,6 +28,23 @@
 
 #define MAXERROR 10
 #define RETRYTIME 10000
+#define MQTTINFLIGHTSIZE 32 // QoS 1/2 messages whose acknowledgement is followed
+#define MQTTBUDGETMSGS 16   // QoS 1/2 messages not yet acknowledged before the next ones wait
+#define MQTTBUDGETBYTES 4096 // bytes (topic + payload) of those messages
+#define MQTTPENDINGSIZE 24  // values waiting for the budget, at most one per topic
+#define MQTTPENDINGPAYLOAD 40 // longest value that can wait, a longer one is sent again by the next report
+#define MQTTMBUSTOPICS 5    // topics of each M-Bus channel : type, id, value, timestamp, breaker
+#define MQTTDISCOVERYPREFIX "homeassistant" // discovery prefix of Home Assistant
+#define MQTTDISCOVERYBATCH 4 // discovery configs published by each DoMe()
+#define MQTTDISCOVERYIDLE 0xFF
+#define MQTTCOMMANDSIZE 48    // longest command accepted on <root>/command
+#define MQTTOVERRIDEMINUTES 10 // duration of an interval command without duration
+#define MQTTOVERRIDEMAXSECONDS 3600 // longest interval of an interval command, 0 ends the override
+#define MQTTOVERRIDEMAXMINUTES 1440 // longest duration of an interval command
+#define MQTTDEBUGSIZE 768   // bytes of debug lines sent in one message on State/Logging
+#define MQTTDEBUGPERIOD 2000 // ms between two debug messages
+#define MQTTDEBUGRATE 10    // debug lines per second kept, beyond that they are dropped
+#define MQTTDEBUGBURST 30   // debug lines kept at once after a quiet period
 
 #include <Arduino.h>
 #include "GlobalVar.h"
@@ -36,22 +53,115 @@
 #include "Debug.h"
 #include "P1Reader.h"
 #include "WifiMgr.h"
+#include "MQTTSpool.h"
 
 class MQTTMgr
 {
+public:
+  /// @brief Topics under conf.mqttTopic, in the order of their names in MQTT.cpp
+  enum class Topic : uint8_t
+  {
+    equipmentName, equipmentID, timestamp,
+    delivered1, delivered2, returned1, returned2, currentlyDelivered, currentlyReturned,
+    deliveredL1, deliveredL2, deliveredL3, returnedL1, returnedL2, returnedL3,
+    voltageL1, voltageL2, voltageL3, currentL1, currentL2, currentL3,
+    gas, water,
+    dsmrVersion, tariff, powerFailures, longPowerFailures, sags, swells, peaks,
+    status, version, ip, logging, json, history, command,
+    mbus, // first of the MQTTMBUSTOPICS topics of each M-Bus channel
+    COUNT = mbus + P1MBUSCOUNT * MQTTMBUSTOPICS
+  };
+  static constexpr Topic MBusTopic(uint8_t channel, uint8_t attribute) { return static_cast<Topic>(static_cast<uint8_t>(Topic::mbus) + (channel - 1) * MQTTMBUSTOPICS + attribute); }
+
 private:
+  char *Topics = nullptr; // full name of every topic, one after the other, built once by BuildTopics()
+  uint16_t TopicOffset[static_cast<uint8_t>(Topic::COUNT)];
+  void BuildTopics();
+  const char *TopicName(Topic topic) const { return Topics + TopicOffset[static_cast<uint8_t>(topic)]; }
+
   unsigned long LastReportinMillis = 0;
+  P1ChangeTracker Changes;
+  uint64_t ReportMask = 0; // P1Reader::FieldBit() of the values sent by the current report
   AsyncMqttClient mqtt_client; // * Initiate MQTT client
   settings &conf;
   WifiMgr &WifiClient;
   P1Reader &DataReaderP1;
+  /// @brief QoS 1/2 message waiting for its acknowledgement
+  struct InFlightMsg
+  {
+    uint16_t packetId;
+    uint8_t qos;
+    uint16_t size;        // topic + payload
+    unsigned long sentAt; // millis()
+  };
+  InFlightMsg InFlight[MQTTINFLIGHTSIZE];
+  uint8_t InFlightCount = 0;
+  /// @brief Value waiting for the budget, replaced if a newer one of the same topic comes
+  struct PendingMsg
+  {
+    Topic topic;
+    uint8_t qos;
+    bool retain;
+    char payload[MQTTPENDINGPAYLOAD];
+  };
+  PendingMsg Pending[MQTTPENDINGSIZE]; // oldest first, Queue.Depth used
+  unsigned long LastDrain = 0;
+  char DebugBatch[MQTTDEBUGSIZE];    // debug lines waiting, separated by '\n'
+  uint16_t DebugLength = 0;
+  unsigned long DebugFlushed = 0;    // millis() of the last debug message
+  uint8_t DebugTokens = MQTTDEBUGBURST; // token bucket of the debug lines
+  unsigned long DebugRefill = 0;     // millis() of the last token added
+  uint32_t DebugDroppedFlushed = 0;  // DebugDropped when the last debug message was sent
+  char Command[MQTTCOMMANDSIZE] = ""; // received on <root>/command, run by DoMe()
+  bool SnapshotRequested = false;    // the next report has all the values, whatever the interval
+  bool DiscoveryChecked = false;     // the configs were compared with the published ones since the connection
+  uint8_t DiscoveryMBus = 0;         // M-Bus channels present when they were compared (bit 0 = channel 1)
+  uint8_t DiscoveryIndex = MQTTDISCOVERYIDLE; // next config to publish
+  uint32_t DiscoveryHash = 0;        // hash of the configs published during this boot
+  uint32_t DiscoveryPending = 0;     // hash of the configs being published
   void onMqttConnect(bool sessionPresent);
   void onMqttDisconnect(AsyncMqttClientDisconnectReason reason);
+  void onMqttPublish(uint16_t packetId);
+  void onMqttMessage(const char *topic, const char *payload, size_t len);
+  /// @brief Run a command of <root>/command : read, snapshot, interval <s> [minutes]
+  void runCommand(const char *command);
+  /// @brief Publish and follow the message until the broker acknowledges it
+  /// @return False if the client didn't accept it (not connected, no memory)
+  bool publish(const char *topic, uint8_t qos, bool retain, const char *payload);
+  /// @brief True if a QoS 1/2 message of this size can be sent without exceeding the budget
+  bool HasBudget(size_t size) const;
+  /// @brief Index in Pending of the value waiting for this topic, -1 if none
+  int8_t findPending(Topic topic) const;
+  /// @brief Keep a value until the budget allows it, newest wins per topic
+  /// @return False if the value was dropped (too long to wait)
+  bool queuePending(Topic topic, uint8_t qos, bool retain, const char *payload);
+  /// @brief Send the values waiting, as long as the budget allows it
+  void flushPending();
+  /// @brief Publish a batch of the readings kept during an outage of the broker
+  void drainSpool();
+  /// @brief Home Assistant discovery config of a sensor, formatted from its template in flash
+  /// @param index Fixed sensors first, then one per M-Bus channel
+  /// @return False if this sensor doesn't exist (M-Bus channel not used) or doesn't fit
+  bool discoveryConfig(uint8_t index, char *topic, size_t topicSize, char *payload, size_t payloadSize);
+  /// @brief Start publishing the discovery configs if they are not the ones already published
+  void startDiscovery();
+  void publishDiscovery();
+  /// @brief Send the debug lines waiting in DebugBatch as one message
+  void flushDebug();
   /// @brief Send a message to a broker topic
   /// @param topic
   /// @param payload
-  void send_msg(const char *topic, const char *payload);
+  /// @param policy Class of the topic (MQTTINSTANT, MQTTCOUNTER or MQTTSTATE), gives its QoS and retain flag
+  /// @return False if the value was dropped instead of being sent or kept in Pending
+  bool send_msg(Topic topic, const char *payload, uint8_t policy);
   char* uint32ToChar(uint32_t value, char* buffer);
+  /// @brief Send a value of the datagram only if it is part of the current report (ReportMask),
+  /// a value dropped is part of the next report again
+  void send_float(P1Reader::Field field, Topic topic, const P1Reader::FixedValue &metric);
+  void send_char(P1Reader::Field field, Topic topic, const char *metric);
+  void send_uint32_t(P1Reader::Field field, Topic topic, uint32_t metric);
+  /// @brief Send the whole datagram as one JSON document on <root>/json
+  void send_json(const P1Reader::DataP1 &data);
   enum {
     CONNECTING,
     CONNECTED,
@@ -60,17 +170,45 @@ private:
   } _state = DISCONNECTED;
   u_int8_t CountError;
 public:
+  /// @brief Publish statistics of one QoS level
+  struct QosStats
+  {
+    uint32_t Sent = 0;
+    uint32_t Acked = 0;
+    uint32_t Lost = 0;        // in flight when the connection was lost, or no longer followed
+    uint16_t InFlight = 0;
+    uint32_t LatencyLast = 0; // ms between publish and acknowledgement
+    uint32_t LatencyAvg = 0;  // ms, moving average on 8 acknowledgements
+    uint32_t LatencyMax = 0;  // ms
+  } Stats[3];
+
+  /// @brief Back-pressure of the broker : values waiting for the budget
+  struct QueueStats
+  {
+    uint8_t Depth = 0;          // values in Pending
+    uint8_t DepthMax = 0;
+    uint16_t InFlightBytes = 0; // of the QoS 1/2 messages not yet acknowledged
+    uint32_t Deferred = 0;      // values that had to wait
+    uint32_t Coalesced = 0;     // replaced by a newer value of the same topic before being sent
+    uint32_t Dropped = 0;       // no room to wait (queue full, value too long)
+  } Queue;
+
+  MQTTSpool Spool; // readings made while the broker is unreachable
+  uint32_t DebugDropped = 0; // debug lines not sent (rate limit or batch full)
+
   long unsigned nextMQTTreconnectAttempt = millis();
 
   explicit MQTTMgr(settings &currentConf, WifiMgr &Link, P1Reader &currentP1);
   void stop();
+  void DoMe();
   bool mqtt_connect();
   bool IsConnected();
 
-  void send_float(String name, float metric);
-  void send_char(String name, const char *metric);
-  void send_uint32_t(String name, uint32_t metric);
+  bool send_float(Topic topic, const P1Reader::FixedValue &metric, uint8_t policy = MQTTSTATE);
+  bool send_char(Topic topic, const char *metric, uint8_t policy = MQTTSTATE);
+  bool send_uint32_t(Topic topic, uint32_t metric, uint8_t policy = MQTTSTATE);
   void MQTT_reporter();
-  void SendDebug(String payload);
+  /// @brief Keep a debug line for the next message on State/Logging
+  void SendDebug(const char *payload);
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2025 Jean-Pierre Sneyers
+ * Source : https://github.com/narfight/P1-wifi-gateway
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additionally, please note that the original source code of this file
+ * may contain portions of code derived from (or inspired by)
+ * previous works by:
+ *
+ * Ronald Leenes (https://github.com/romix123/P1-wifi-gateway and http://esp8266thingies.nl)
+ */
+
+#include "MQTTSpool.h"
+#include "Debug.h"
+
+void MQTTSpool::Load()
+{
+  File file = LittleFS.open(MQTTSPOOLFILE, "r");
+  if (!file) {
+    return;
+  }
+
+  // left by the previous boot
+  Header header = {};
+  size_t size = file.size();
+  bool valid = (size >= sizeof(header)) && (((size - sizeof(header)) % sizeof(Record)) == 0) &&
+    (file.read(reinterpret_cast<uint8_t *>(&header), sizeof(header)) == sizeof(header));
+  file.close();
+
+  uint32_t records = valid ? (size - sizeof(header)) / sizeof(Record) : 0;
+  if (!valid || (header.readIndex >= records)) {
+    LittleFS.remove(MQTTSPOOLFILE); // damaged or already published
+    return;
+  }
+
+  ReadIndex = header.readIndex;
+  Depth = records - ReadIndex;
+  MainSendDebugPrintf("[MQTT] %u readings waiting in the spool", Depth);
+}
+
+void MQTTSpool::Append(const P1Reader::DataP1 &data)
+{
+  if ((LastAppend != 0) && ((millis() - LastAppend) < MQTTSPOOLPERIOD)) {
+    return;
+  }
+  LastAppend = millis();
+
+  if (ReadIndex + Depth >= MQTTSPOOLMAX) {
+    Dropped++;
+    return;
+  }
+
+  Record record = {};
+  record.electricityUsedTariff1 = data.electricityUsedTariff1;
+  record.electricityUsedTariff2 = data.electricityUsedTariff2;
+  record.electricityReturnedTariff1 = data.electricityReturnedTariff1;
+  record.electricityReturnedTariff2 = data.electricityReturnedTariff2;
+  record.actualElectricityPowerDeli = data.actualElectricityPowerDeli;
+  record.actualElectricityPowerRet = data.actualElectricityPowerRet;
+  record.epoch = data.P1epoch;
+
+  uint8_t gas = data.FindMBus(MBUS_GAS);
+  if (gas != 0) {
+    record.gas = data.mbus[gas - 1].value;
+    record.gasEpoch = data.mbus[gas - 1].epoch;
+  }
+
+  File file = LittleFS.open(MQTTSPOOLFILE, "a");
+  if (!file) {
+    Dropped++;
+    return;
+  }
+  if (file.size() == 0) {
+    Header header = {0};
+    file.write(reinterpret_cast<const uint8_t *>(&header), sizeof(header));
+  }
+  if (file.write(reinterpret_cast<const uint8_t *>(&record), sizeof(record)) == sizeof(record)) {
+    Depth++;
+  }
+  else {
+    Dropped++;
+  }
+  file.close();
+}
+
+uint8_t MQTTSpool::Read(Record *records, uint8_t max)
+{
+  if (Depth == 0) {
+    return 0;
+  }
+
+  File file = LittleFS.open(MQTTSPOOLFILE, "r");
+  if (!file) {
+    Depth = 0;
+    return 0;
+  }
+
+  uint8_t count = (Depth < max) ? Depth : max;
+  file.seek(sizeof(Header) + ReadIndex * sizeof(Record));
+  count = file.read(reinterpret_cast<uint8_t *>(records), count * sizeof(Record)) / sizeof(Record);
+  file.close();
+  return count;
+}
+
+void MQTTSpool::Consume(uint8_t count)
+{
+  unsigned long now = millis();
+  if ((now - RateStart) >= MQTTSPOOLRATEWINDOW) {
+    DrainRate = RateCount * 1000 / (now - RateStart);
+    RateStart = now;
+    RateCount = 0;
+  }
+  if (count == 0) {
+    return; // publishing is blocked, the header is not written again for nothing
+  }
+  RateCount += count;
+  Drained += count;
+
+  ReadIndex += count;
+  Depth -= (count < Depth) ? count : Depth;
+  if (Depth == 0) {
+    // everything is published, the next outage starts a new file
+    LittleFS.remove(MQTTSPOOLFILE);
+    ReadIndex = 0;
+    DrainRate = 0;
+    RateCount = 0;
+    MainSendDebug("[MQTT] Spool drained");
+    return;
+  }
+
+  File file = LittleFS.open(MQTTSPOOLFILE, "r+");
+  if (file) {
+    Header header = {ReadIndex};
+    file.write(reinterpret_cast<const uint8_t *>(&header), sizeof(header));
+    file.close();
+  }
+}
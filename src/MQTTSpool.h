@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2025 Jean-Pierre Sneyers
+ * Source : https://github.com/narfight/P1-wifi-gateway
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additionally, please note that the original source code of this file
+ * may contain portions of code derived from (or inspired by)
+ * previous works by:
+ *
+ * Ronald Leenes (https://github.com/romix123/P1-wifi-gateway and http://esp8266thingies.nl)
+ */
+
+#ifndef MQTTSPOOL_H
+#define MQTTSPOOL_H
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include "GlobalVar.h"
+#include "P1Reader.h"
+
+#define MQTTSPOOLFILE "/MQTTSpool.bin"
+#define MQTTSPOOLMAX 1440         // records kept while the broker is unreachable (one day at one per minute)
+#define MQTTSPOOLPERIOD 60000     // ms between two records
+#define MQTTSPOOLBATCH 5          // records published by each drain
+#define MQTTSPOOLDRAINPERIOD 500  // ms between two drains
+#define MQTTSPOOLRATEWINDOW 10000 // ms over which the drain rate is measured
+
+/// @brief Append-only file of the readings made while the MQTT broker is unreachable, published again once it is back.
+/// The file starts with a Header, then the records.
+class MQTTSpool
+{
+public:
+  /// @brief Counters and totals of a datagram, with its time
+  struct Record
+  {
+    P1Reader::FixedValue electricityUsedTariff1;
+    P1Reader::FixedValue electricityUsedTariff2;
+    P1Reader::FixedValue electricityReturnedTariff1;
+    P1Reader::FixedValue electricityReturnedTariff2;
+    P1Reader::FixedValue actualElectricityPowerDeli;
+    P1Reader::FixedValue actualElectricityPowerRet;
+    P1Reader::FixedValue gas;
+    uint32_t epoch;    // P1epoch of the datagram
+    uint32_t gasEpoch; // capture time of gas, 0 without gas meter
+  };
+
+  uint32_t Depth = 0;     // records waiting in the file
+  uint32_t Dropped = 0;   // records not written because the file is full
+  uint32_t Drained = 0;   // records published again
+  uint32_t DrainRate = 0; // records/s published during the last MQTTSPOOLRATEWINDOW
+
+  /// @brief Find the records left by the previous boot, to be called at startup
+  void Load();
+  /// @brief Keep the datagram if the last record is older than MQTTSPOOLPERIOD
+  void Append(const P1Reader::DataP1 &data);
+  /// @brief Read the next records without removing them
+  /// @return Number of records read, at most max
+  uint8_t Read(Record *records, uint8_t max);
+  /// @brief Remove the first records, once they are published (nothing is written when count is 0)
+  void Consume(uint8_t count);
+  /// @brief Size of the file
+  uint32_t Bytes() const { return ((ReadIndex + Depth) == 0) ? 0 : sizeof(Header) + (ReadIndex + Depth) * sizeof(Record); }
+
+private:
+  /// @brief Start of the file
+  struct Header
+  {
+    uint32_t readIndex; // records already published, so a reboot during a drain doesn't publish them again
+  };
+  uint32_t ReadIndex = 0;       // records of the file already published
+  unsigned long LastAppend = 0; // millis()
+  unsigned long RateStart = 0;  // millis() of the start of the rate window
+  uint32_t RateCount = 0;       // records published since RateStart
+};
+#endif
@@ -29,6 +29,7 @@
 
 #include <Arduino.h>
 #include <EEPROM.h>
+#include <stddef.h> // offsetof()
 #include "GlobalVar.h"
 
 char clientName[CLIENTNAMESIZE];
@@ -71,37 +72,17 @@ void MainSendDebug(const char *payload)
 
 void MainSendDebugPrintf(const char *format, ...)
 {
-  const int initialBufferSize = 128;
-  const int maxBufferSize = 1024;
-  char* buffer = nullptr;
-  int bufferSize = initialBufferSize;
-  int length = 0;
+  char buffer[DEBUGLINESIZE]; // on the stack, a debug line never takes heap
   va_list args;
 
-  do {
-    delete[] buffer;  // Safe to call on nullptr in first iteration
-    buffer = new char[bufferSize];
-        
-    va_start(args, format);
-    length = vsnprintf(buffer, bufferSize, format, args);
-    va_end(args);
-
-    if (length < 0) {
-      delete[] buffer;
-      return;
-    }
-
-    if (length >= bufferSize) {
-      bufferSize *= 2;  // Double the buffer size
-      if (bufferSize > maxBufferSize) {
-        delete[] buffer;
-        return;
-      }
-    }
-  } while (length >= bufferSize);
+  va_start(args, format);
+  int length = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
 
+  if (length < 0) {
+    return;
+  }
   MainSendDebug(buffer);
-  delete[] buffer;
 }
 
 /// @brief Non-blocking delay using yield() to yield control back to the CPU.
@@ -146,7 +127,16 @@ void PrintConfigData()
   MainSendDebugPrintf("   # Send debug here : %s", (config_data.debugToMqtt) ? "Y" : "N");
   MainSendDebugPrintf("   # MQTT : mqtt://%s:***@%s:%u", config_data.mqttUser, config_data.mqttIP, config_data.mqttPort);
   MainSendDebugPrintf("   # MQTT Topic : %s", config_data.mqttTopic);
+  MainSendDebugPrintf("   # MQTT JSON : %s (QoS %u)", (config_data.mqttJson) ? "Y" : "N", config_data.mqttQos);
+  MainSendDebugPrintf("   # MQTT QoS/retain : instant %u/%s, counter %u/%s, state %u/%s",
+    config_data.mqttPolicyQos[MQTTINSTANT], (config_data.mqttPolicyRetain[MQTTINSTANT]) ? "Y" : "N",
+    config_data.mqttPolicyQos[MQTTCOUNTER], (config_data.mqttPolicyRetain[MQTTCOUNTER]) ? "Y" : "N",
+    config_data.mqttPolicyQos[MQTTSTATE], (config_data.mqttPolicyRetain[MQTTSTATE]) ? "Y" : "N");
   MainSendDebugPrintf(" - interval : %u", config_data.interval);
+  MainSendDebugPrintf(" - Continuous read : %s", (config_data.ContinuousRead) ? "Y" : "N");
+  MainSendDebugPrintf("   # MQTT interval : %u", config_data.mqttInterval);
+  MainSendDebugPrintf("   # Domoticz interval : %u", config_data.domoInterval);
+  MainSendDebugPrintf(" - Full refresh : %u (deadbands %u W, %u dV)", config_data.fullRefresh, config_data.deadbandPower, config_data.deadbandVoltage);
   MainSendDebugPrintf(" - Invert high/low tarif: %s", (config_data.InverseHigh_1_2_Tarif) ? "Y" : "N");
   MainSendDebugPrintf(" - TELNET Actif : %s", (config_data.telnet) ? "Y" : "N");
   MainSendDebugPrintf("   # Send debug here : %s", (config_data.debugToTelnet) ? "Y" : "N");
@@ -206,6 +196,17 @@ void setup()
   EEPROM.begin(sizeof(struct settings));
   EEPROM.get(0, config_data);
 
+  const settings defaults = (settings){SETTINGVERSION, 0, true, "", "", "10.0.0.3", 8084, 0, 0, "dsmr", "10.0.0.3", 1883, "", "", 60, false, false, false, false, false, false, "", "", false, false, 0, 0, 0, 5, 5, false, 1, {0, 1, 2}, {false, true, true}};
+
+  // Version 2 is the beginning of the current settings : keep it (WiFi, ...), the new fields take their default
+  if ((config_data.ConfigVersion == SETTINGVERSIONV2) && (config_data.BootFailed < MAXBOOTFAILURE)) {
+    MainSendDebugPrintf("[Core] Upgrade settings (from:%d to:%d)", SETTINGVERSIONV2, SETTINGVERSION);
+    settings previous = config_data;
+    config_data = defaults;
+    memcpy(static_cast<void *>(&config_data), &previous, offsetof(settings, ContinuousRead));
+    config_data.ConfigVersion = SETTINGVERSION;
+  }
+
   // If the configuration version is not the expected one, we reset!
   if ((config_data.ConfigVersion != SETTINGVERSION) || (config_data.BootFailed >= MAXBOOTFAILURE)) {    
     if (config_data.ConfigVersion != SETTINGVERSION) {
@@ -218,7 +219,7 @@ void setup()
     //Show to user is reseted !
     blink(20, 50UL);
 
-    config_data = (settings){SETTINGVERSION, 0, true, "", "", "10.0.0.3", 8084, 0, 0, "dsmr", "10.0.0.3", 1883, "", "", 60, false, false, false, false, false, false, "", "", false};
+    config_data = defaults;
   }
   else {
     config_data.BootFailed++;
@@ -234,6 +235,7 @@ void setup()
 
   WifiClient = new WifiMgr(config_data);
   DataReaderP1 = new P1Reader(config_data);
+  LogP1 = new LogP1Mgr(config_data, *DataReaderP1); // mounts LittleFS, used by the MQTT spool
 
   if (config_data.telnet) {
     TelnetServer = new TelnetMgr(config_data, *DataReaderP1);
@@ -247,13 +249,13 @@ void setup()
     DomoClient = new DomoticzMgr(config_data, *DataReaderP1);
   }
   
-  LogP1 = new LogP1Mgr(config_data, *DataReaderP1);
-  HTTPClient = new HTTPMgr(config_data, *TelnetServer, *MQTTClient, *DataReaderP1, *LogP1);
+  HTTPClient = new HTTPMgr(config_data, *TelnetServer, *MQTTClient, *DomoClient, *DataReaderP1, *LogP1);
 
   blink(2, 500UL); // blink twice to signal that the module is ready!
 
   WifiClient->Connect();
   HTTPClient->start_webservices();
+  MainSendDebugPrintf("[Core] Free heap after boot : %u bytes", ESP.getFreeHeap());
 }
 
 /// @brief Check the amount of RAM available and reset the number of boot errors if necessary
@@ -286,6 +288,14 @@ void loop()
     TelnetServer->DoMe();
   }
 
+  if (MQTTClient != nullptr) {
+    MQTTClient->DoMe();
+  }
+
+  if (DomoClient != nullptr) {
+    DomoClient->DoMe();
+  }
+
   if (millis() > WatchDogsTimer) {
     doWatchDogs();
   }
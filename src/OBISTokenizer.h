@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2025 Jean-Pierre Sneyers
+ * Source : https://github.com/narfight/P1-wifi-gateway
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additionally, please note that the original source code of this file
+ * may contain portions of code derived from (or inspired by)
+ * previous works by:
+ *
+ * Ronald Leenes (https://github.com/romix123/P1-wifi-gateway and http://esp8266thingies.nl)
+ */
+
+#ifndef OBISTOKENIZER_H
+#define OBISTOKENIZER_H
+
+#include <Arduino.h>
+
+/// @brief Non-owning view (pointer + length) on a part of the telegram buffer
+struct P1Span
+{
+  const char *ptr = nullptr;
+  uint16_t len = 0;
+
+  P1Span() = default;
+  P1Span(const char *start, uint16_t length) : ptr(start), len(length) {}
+
+  bool empty() const { return len == 0; }
+
+  /// @brief Copy the span in a C string, truncated to the size of the destination
+  /// @param dest Destination buffer
+  /// @param size Size of the destination buffer (with the null character)
+  void copyTo(char *dest, size_t size) const
+  {
+    if (size == 0) {
+      return;
+    }
+    size_t count = (len < size - 1) ? len : size - 1;
+    memcpy(dest, ptr, count);
+    dest[count] = '\0';
+  }
+
+  /// @brief Read the leading digits as an unsigned value (leading zeros are ignored)
+  /// @return the value, 0 if the span does not start with a digit
+  uint32_t toUInt() const
+  {
+    uint32_t result = 0;
+    for (uint16_t i = 0; (i < len) && isDigit(ptr[i]); i++) {
+      result = result * 10 + (ptr[i] - '0');
+    }
+    return result;
+  }
+};
+
+/// @brief One "(...)" group of a telegram line, split on the '*' between the value and the unit
+struct OBISGroup
+{
+  P1Span value; // 000992.992
+  P1Span unit;  // kWh, empty if the group doesn't have a unit
+};
+
+/// @brief Splits a telegram line like "1-0:1.8.1(000992.992*kWh)" in its OBIS reference and its groups.
+/// Everything is returned as P1Span on the line, so nothing is copied or allocated.
+class OBISTokenizer
+{
+public:
+  /// @brief OBIS reference of the line (ex: 1-0:1.8.1)
+  P1Span id;
+
+  /// @brief Start the tokenization of a new line
+  /// @param line First char of the line
+  /// @param len Length of the line
+  /// @return false if the line doesn't have any group (header, empty line, ...)
+  bool begin(const char *line, uint16_t len)
+  {
+    while ((len > 0) && ((line[len - 1] == '\n') || (line[len - 1] == '\r'))) {
+      len--; // the end of line is not part of the values
+    }
+
+    end = line + len;
+    const char *open = static_cast<const char *>(memchr(line, '(', len));
+    if (open == nullptr) {
+      id = P1Span();
+      cursor = end;
+      return false;
+    }
+
+    id = P1Span(line, open - line);
+    cursor = open;
+    return true;
+  }
+
+  /// @brief Read the next group of the line
+  /// @param group Receives the value and the unit of the group
+  /// @return false if there are no more (complete) groups
+  bool next(OBISGroup &group)
+  {
+    if ((cursor >= end) || (*cursor != '(')) {
+      return false;
+    }
+
+    const char *start = cursor + 1;
+    const char *close = static_cast<const char *>(memchr(start, ')', end - start));
+    if (close == nullptr) {
+      return false;
+    }
+
+    const char *star = static_cast<const char *>(memchr(start, '*', close - start));
+    if (star != nullptr) {
+      group.value = P1Span(start, star - start);
+      group.unit = P1Span(star + 1, close - star - 1);
+    }
+    else {
+      group.value = P1Span(start, close - start);
+      group.unit = P1Span();
+    }
+
+    cursor = close + 1;
+    return true;
+  }
+
+  /// @brief Part of the line not yet read, starting at the next group
+  P1Span rest() const
+  {
+    return P1Span(cursor, end - cursor);
+  }
+
+private:
+  const char *cursor = nullptr;
+  const char *end = nullptr;
+};
+#endif
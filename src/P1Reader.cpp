@@ -22,34 +22,58 @@
  * Ronald Leenes (https://github.com/romix123/P1-wifi-gateway and http://esp8266thingies.nl)
  */
 
+#include <stddef.h>
 #include "P1Reader.h"
 
 P1Reader::P1Reader(settings &currentConf) : conf(currentConf)
 {
-  Serial.setRxBufferSize(MAXLINELENGTH-2);
-  //Serial.begin(SERIALSPEED);
-  Serial.begin(SERIALSPEED, SERIAL_8N1, SERIAL_FULL, 1, true);
-  datagram.reserve(1500);
+  Uart.begin();
 }
 
 void P1Reader::RTS_on() // switch on Data Request
 {
   MainSendDebug("[P1] Data requested");
   Serial.flush(); //flush output buffer
-  while(Serial.available() > 0 ) Serial.read(); //flush input buffer
+  Source->flush(); //flush input buffer
+  FrameLength = 0;
+  LineLength = 0;
   
   state = State::WAITING; // signal that we are waiting for a valid start char (aka /)
-  digitalWrite(OE, LOW); // enable buffer
-  digitalWrite(DR, HIGH); // turn on Data Request
+  Source->Request(true);
   TimeOutRead = millis() + P1TIMEOUTREAD; //max read time
 }
 
 void P1Reader::RTS_off() // switch off Data Request
 {
   state = State::DISABLED;
-  nextUpdateTime = millis() + conf.interval * 1000;
-  digitalWrite(DR, LOW); // turn off Data Request
-  digitalWrite(OE, HIGH); // put buffer in Tristate mode
+  unsigned int interval = GetIntervalOverride();
+  if (Source == &Replay) {
+    nextUpdateTime = millis(); // the replay clock gives the pace of the datagrams, not the interval
+  }
+  else {
+    nextUpdateTime = millis() + ((interval != 0) ? interval : conf.interval) * 1000;
+  }
+  Source->Request(false);
+}
+
+bool P1Reader::StartReplay(const char *path, uint16_t speed)
+{
+  RTS_off(); // no more Data Request on the meter
+  if (!Replay.Open(path, speed)) {
+    StopReplay();
+    return false;
+  }
+  Source = &Replay;
+  nextUpdateTime = 0;
+  return true;
+}
+
+void P1Reader::StopReplay()
+{
+  RTS_off();
+  Replay.Close();
+  Source = &Uart;
+  nextUpdateTime = 0;
 }
 
 void P1Reader::ResetnextUpdateTime()
@@ -58,6 +82,27 @@ void P1Reader::ResetnextUpdateTime()
   nextUpdateTime = 0;
 }
 
+void P1Reader::SetIntervalOverride(unsigned int seconds, unsigned long duration)
+{
+  IntervalOverride = seconds;
+  IntervalOverrideEnd = millis() + duration;
+  if (seconds != 0) {
+    MainSendDebugPrintf("[P1] Interval %us for %lus", seconds, duration / 1000);
+  }
+  if (state == State::DISABLED) {
+    ResetnextUpdateTime(); // the next read with the new interval
+  }
+}
+
+unsigned int P1Reader::GetIntervalOverride()
+{
+  if ((IntervalOverride != 0) && ((long)(millis() - IntervalOverrideEnd) >= 0)) {
+    IntervalOverride = 0;
+    MainSendDebugPrintf("[P1] Back to the interval of %us", conf.interval);
+  }
+  return IntervalOverride;
+}
+
 int P1Reader::FindCharInArray(const char array[], char c, int len)
 {
   for (int i = 0; i < len; i++) {
@@ -68,6 +113,53 @@ int P1Reader::FindCharInArray(const char array[], char c, int len)
   return -1;
 }
 
+/// @brief Add bytes to the CRC16/ARC (poly 0xA001 reflected) of the current datagram
+/// @param data First byte to add
+/// @param len Number of bytes
+void P1Reader::UpdateCRC(const char *data, int len)
+{
+  static const uint16_t nibbleTable[16] PROGMEM = {
+    0x0000, 0xCC01, 0xD801, 0x1400, 0xF001, 0x3C00, 0x2800, 0xE401,
+    0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400
+  };
+
+  for (int i = 0; i < len; i++) {
+    uint8_t octet = data[i];
+    CRC = (CRC >> 4) ^ pgm_read_word(&nibbleTable[(CRC ^ octet) & 0x0F]);
+    CRC = (CRC >> 4) ^ pgm_read_word(&nibbleTable[(CRC ^ (octet >> 4)) & 0x0F]);
+  }
+}
+
+/// @brief Compare the CRC of the datagram with the one given after the '!'
+/// @param endChar Position of the '!' in the line
+/// @param len Length of the line
+/// @return true if the CRC matches, or if it is missing from a meter that doesn't send one (DSMR < 4)
+bool P1Reader::CheckCRC(const char *line, int endChar, int len)
+{
+  uint16_t expected = 0;
+  int digits = 0;
+
+  for (int i = endChar + 1; (i < len) && (digits < 4) && isHexadecimalDigit(line[i]); i++, digits++) {
+    char c = line[i];
+    expected = (expected << 4) | ((c <= '9') ? (c - '0') : ((c | 0x20) - 'a' + 10));
+  }
+
+  if (digits == 0) {
+    // DSMR 2.2 and 3 have no CRC, for a newer meter or one that sent a CRC the line was cut after the '!'
+    uint8_t version = DSMRVersion;
+    if ((version == 0) && isDigit(BackBuffer().P1version[0])) {
+      version = BackBuffer().P1version[0] - '0'; // 0-0:96.1.4(50217) of the Belgian meters
+    }
+    return !CRCSeen && (version < 4);
+  }
+
+  if ((digits == 4) && (expected == CRC)) {
+    CRCSeen = true;
+    return true;
+  }
+  return false;
+}
+
 String P1Reader::identifyMeter(String Name)
 {
   if (Name.indexOf("FLU5\\") != -1)            { return "Siconia"; } //Belgium
@@ -79,30 +171,43 @@ String P1Reader::identifyMeter(String Name)
   return "UNKNOW";
 }
 
-void P1Reader::decodeTelegram(int len)
+/// @brief Handle a complete line of the datagram
+/// @param line Start of the line in the arena, right after the previous lines of the datagram
+/// @param len Length of the line (with its end of line)
+void P1Reader::decodeTelegram(char *line, int len)
 {
-  int startChar = FindCharInArray(telegram, '/', len);
-  int endChar   = FindCharInArray(telegram, '!', len);
+  int startChar = FindCharInArray(line, '/', len);
+  int endChar   = FindCharInArray(line, '!', len);
 
   if (state == State::WAITING) { // we're waiting for a valid start sequence, if this line is not it, just return
     if (startChar >= 0) {
       // start found. Reset CRC calculation
       MainSendDebug("[P1] Start of datagram found");
+      if (startChar > 0) {
+        len -= startChar;
+        memmove(line, line + startChar, len + 1); // the datagram begins at the start of its frame (with the null char)
+      }
+      CRC = 0;
+      UpdateCRC(line, len);
       
-      digitalWrite(DR, LOW);  // turn off Data Request
-      digitalWrite(OE, HIGH); // put buffer in Tristate mode
+      if (!conf.ContinuousRead) {
+        Source->Request(false); // the rest of this datagram still comes
+      }
       
-      // reset datagram
-      datagram = "";
+      // reset datagram, the lines that are not in this one keep their last value
+      FrameLength = len;
+      FrameDecodeTime = 0;
       dataEnd = false;
+      BackBuffer() = GetData();
+      BackBuffer().changed = 0;
+      ReferenceMoved = 0;
+      TemplatePos = 0;
+      FrameLines = 0;
+      FrameMisses = 0;
       state = State::READING;
 
-      for (int cnt = startChar; cnt < (len - startChar); cnt++) {
-        datagram += telegram[cnt];
-      }
-
       if (meterName == "") {
-        meterName = identifyMeter(telegram);
+        meterName = identifyMeter(line);
       }
 
       return;
@@ -113,317 +218,546 @@ void P1Reader::decodeTelegram(int len)
   }
 
   if (state == State::READING) {
+    FrameLength += len; // the line stays in the arena, just after the previous one
+
     if (endChar >= 0) {
       // we have found the endchar !
       MainSendDebug("[P1] End found");
-      dataEnd = true; // we're at the end of the data stream, so mark (for raw data output) We don't know if the data is valid, we will test this below.
-     
-      if (datagram.length() < 2048) {
-        for (int cnt = 0; cnt < len; cnt++) {
-          datagram += telegram[cnt];
-        }
-        datagram += "\r\n";
-      }
-      else {
-        MainSendDebug("[P1] Buffer overflow ?");
+      UpdateCRC(line, endChar + 1); // the '!' is part of the CRC
+
+      size_t frameLength = FrameLength;
+      FrameLength = 0;
+
+      if (!CheckCRC(line, endChar, len)) {
+        FramesRejected++;
+        MainSendDebugPrintf("[P1] Bad CRC, datagram dropped (%u rejected)", FramesRejected);
         state = State::FAULT;
         return;
       }
 
+      FramesAccepted++;
+      dataEnd = true; // we're at the end of the data stream and the CRC is valid
+
+      if (TemplateCount == 0) {
+        TemplateCount = TemplatePos; // the lines of this valid datagram are now the expected ones
+        MainSendDebugPrintf("[P1] %u lines learnt", TemplateCount);
+      }
+      else if (FrameMisses > FrameLines / 2) {
+        TemplateCount = 0; // another meter or another firmware : learn the next datagram again
+      }
+
+      // the deadbands now start from the values of this valid datagram
+      for (uint8_t i = 0; i < static_cast<uint8_t>(Field::COUNT); i++) {
+        if (ReferenceMoved & FieldBit(static_cast<Field>(i))) {
+          ChangeReference[i] = ReferenceCandidate[i];
+        }
+      }
+
+      // publish the new datagram and its raw text
+      BackBuffer().sequence = GetData().sequence + 1;
+      RawLength = frameLength;
+      FrontBuffer ^= 1;
       state = State::DONE;
       LastSample = millis();
       return;
     }
     else { 
       // no endchar, so normal line, process
-      for (int cnt = 0; cnt < len; cnt++) {
-        datagram += telegram[cnt];
-      }
-      OBISparser(len);
+      UpdateCRC(line, len);
+      OBISparser(line, len);
     }
     return;
   }
   return;
 }
 
-String P1Reader::readFirstParenthesisVal(int start, int end)
+/// @brief Kind of value carried by an OBIS line
+enum class OBISKind : uint8_t
 {
-  String value = "";
-  int i = start + 1;
-  bool trailingZero = true;
-  while ((telegram[i] != ')') && (i < end))
-  {
-    if (trailingZero && telegram[i] == '0') {
-      i++;
+  IGNORE,      // known line, not stored
+  FIXED,       // (000992.992*kWh) stored as FixedValue
+  INTEGER,     // (00051) stored as uint32_t
+  TEXT,        // (50221) stored as char[]
+  DATETIME,    // (200512135409S) stored as char[] and as epoch in P1epoch
+  TIMESTAMPED, // (200512134558S)(00112.384*m3) value of the second group stored as FixedValue
+  RAW,         // all the groups of the line stored as char[]
+  PEAKS,       // (3)(1-0:1.6.0)(1-0:1.6.0)(month)(time of the peak)(03.695*kW)... stored as PeakP1[]
+  MBUSTYPE,    // (003) device type of an M-Bus channel
+  MBUSID,      // (3853414731323334353637383930) identifier of an M-Bus device, hexadecimal
+  MBUSREADING, // (200512134558S)(00112.384*m3) value of an M-Bus device and its capture time
+  MBUSBREAKER, // (1) valve or breaker state of an M-Bus device (last group of the line)
+  DSMRVERSION  // (42) version of DSMR, its major digit kept in DSMRVersion
+};
+
+/// @brief Minimal variation for a FIXED value to be flagged as changed (see settings)
+enum class OBISDeadband : uint8_t
+{
+  NONE,    // any variation
+  POWER,   // deadbandPower (W)
+  VOLTAGE  // deadbandVoltage (0.1 V)
+};
+
+/// @brief Descriptor of an OBIS code : where and how its value is stored in DataP1
+struct OBISField
+{
+  uint32_t key;            // OBISKey() of the reference
+  OBISKind kind;
+  bool tariff;             // follows the setting InverseHigh_1_2_Tarif
+  OBISDeadband deadband;
+  uint16_t offset;         // member of DataP1 that receives the value
+  uint16_t size;           // size of this member (for TEXT and RAW)
+  uint16_t offsetInverted; // member used when the tariffs are inverted
+  P1Reader::Field field;   // bit of the member in DataP1::changed
+  P1Reader::Field fieldInverted;
+};
+
+/// @brief Packs an OBIS reference A-B:C.D.E in 32 bits (A and B are on 4 bits, that is enough for DSMR)
+constexpr uint32_t OBISKey(uint8_t a, uint8_t b, uint8_t c, uint8_t d, uint8_t e)
+{
+  return ((uint32_t)(a & 0x0F) << 28) | ((uint32_t)(b & 0x0F) << 24) | ((uint32_t)c << 16) | ((uint32_t)d << 8) | e;
+}
+
+#define MBUS 0x0F // B of the codes of the M-Bus channels (0-1 to 0-4) in OBISFields
+
+#define OBIS_MEMBER(member) offsetof(P1Reader::DataP1, member), sizeof(P1Reader::DataP1::member)
+#define OBIS_FIELD(a, b, c, d, e, kind, member) { OBISKey(a, b, c, d, e), OBISKind::kind, false, OBISDeadband::NONE, OBIS_MEMBER(member), offsetof(P1Reader::DataP1, member), P1Reader::Field::member, P1Reader::Field::member }
+#define OBIS_VALUE(a, b, c, d, e, deadband, member) { OBISKey(a, b, c, d, e), OBISKind::FIXED, false, OBISDeadband::deadband, OBIS_MEMBER(member), offsetof(P1Reader::DataP1, member), P1Reader::Field::member, P1Reader::Field::member }
+#define OBIS_TARIFF(a, b, c, d, e, kind, member, inverted) { OBISKey(a, b, c, d, e), OBISKind::kind, true, OBISDeadband::NONE, OBIS_MEMBER(member), offsetof(P1Reader::DataP1, inverted), P1Reader::Field::member, P1Reader::Field::inverted }
+#define OBIS_MBUS(c, d, e, kind) { OBISKey(0, MBUS, c, d, e), OBISKind::kind, false, OBISDeadband::NONE, 0, 0, 0, P1Reader::Field::mbus1, P1Reader::Field::mbus1 }
+#define OBIS_VERSION(a, b, c, d, e) { OBISKey(a, b, c, d, e), OBISKind::DSMRVERSION, false, OBISDeadband::NONE, 0, 0, 0, P1Reader::Field::COUNT, P1Reader::Field::COUNT }
+#define OBIS_IGNORE(a, b, c, d, e) { OBISKey(a, b, c, d, e), OBISKind::IGNORE, false, OBISDeadband::NONE, 0, 0, 0, P1Reader::Field::COUNT, P1Reader::Field::COUNT }
+
+/// @brief All the OBIS codes known by the parser, sorted on their key for the binary search
+static constexpr OBISField OBISFields[] PROGMEM = {
+  OBIS_FIELD (0, 0,  1,  0,  0, DATETIME,    P1timestamp),                // 0-0:1.0.0(200512135409S)                         DateTime YYMMDDhhmmssX
+  OBIS_IGNORE(0, 0, 17,  0,  0),                                           // 0-0:17.0.0(99.999*kW)                            Limiter threshold in kW
+  OBIS_IGNORE(0, 0, 24,  1,  0),                                           // 0-n:24.1.0                                       Equipment identifier
+  OBIS_FIELD (0, 0, 96,  1,  1, TEXT,        equipmentId),                // 0-0:96.1.1(3153414733313031303231363035)         Equipment identifier electricity
+  OBIS_IGNORE(0, 0, 96,  1,  2),                                           // 0-0:96.1.2(353431343430303132333435363738393030) EAN code
+  OBIS_FIELD (0, 0, 96,  1,  4, TEXT,        P1version),                  // 0-0:96.1.4(50221)                                Version information
+  OBIS_IGNORE(0, 0, 96,  3, 10),                                           // 0-0:96.3.10(1)                                   Breaker state
+  OBIS_FIELD (0, 0, 96,  7,  9, INTEGER,     numberLongPowerFailuresAny), // 0-0:96.7.9(00007)                                Number of long power failures in any phase
+  OBIS_FIELD (0, 0, 96,  7, 21, INTEGER,     numberPowerFailuresAny),     // 0-0:96.7.21(00051)                               Number of power failures in any phase
+  OBIS_IGNORE(0, 0, 96, 13,  0),                                           // 0-0:96.13.0()                                    Text message (max 1024 characters)
+  OBIS_IGNORE(0, 0, 96, 13,  1),                                           // 0-0:96.13.1                                      Consumer message code
+  OBIS_TARIFF(0, 0, 96, 14,  0, INTEGER,     tariffIndicatorElectricity, tariffIndicatorElectricity), // 0-0:96.14.0(0001)       Tariff indicator (1: High/normal, 2: low)
+  OBIS_FIELD (0, 0, 98,  1,  0, PEAKS,       peaks),                      // 0-0:98.1.0(3)(1-0:1.6.0)(1-0:1.6.0)(200501000000S)(200423192538S)(03.695*kW)... Maximum demand history
+  OBIS_MBUS  (      24,  1,  0, MBUSTYPE),                                // 0-n:24.1.0(003)                                  Device type (3: gas, 4: heat, 7: water)
+  OBIS_IGNORE(0, MBUS, 24,  2,  0),                                        // 0-n:24.2.0                                       M-Bus device type
+  OBIS_MBUS  (      24,  2,  1, MBUSREADING),                             // 0-n:24.2.1(200512134558S)(00112.384*m3)          Last value (temperature converted)
+  OBIS_MBUS  (      24,  2,  3, MBUSREADING),                             // 0-n:24.2.3(200512134558S)(00112.384*m3)          Last value (not temperature converted)
+  OBIS_MBUS  (      24,  2,  4, MBUSBREAKER),                             // 0-n:24.2.4                                       Breaker state
+  OBIS_MBUS  (      24,  4,  0, MBUSBREAKER),                             // 0-n:24.4.0(1)                                    Valve position
+  OBIS_MBUS  (      96,  1,  0, MBUSID),                                  // 0-n:96.1.0(37464C4F32313139303333373333)         Equipment identifier
+  OBIS_MBUS  (      96,  1,  1, MBUSID),                                  // 0-n:96.1.1(37464C4F32313139303333373333)         Equipment identifier
+  OBIS_IGNORE(0, MBUS, 96,  1,  2),                                        // 0-n:96.1.2(353431343430303132333435363738393030) EAN code
+  OBIS_MBUS  (      96,  3, 10, MBUSBREAKER),                             // 0-n:96.3.10(0)                                   Breaker state
+  OBIS_VALUE (1, 0,  1,  4,  0, POWER,       activeEnergyActual),         // 1-0:1.4.0(02.351*kW)                             Current average demand active energy import in kW
+  OBIS_FIELD (1, 0,  1,  6,  0, TIMESTAMPED, activeEnergyMaximumOfThisMonth), // 1-0:1.6.0(200509134558S)(02.589*kW)          Maximum demand active energy import of the current month in kW
+  OBIS_VALUE (1, 0,  1,  7,  0, POWER,       actualElectricityPowerDeli), // 1-0:1.7.0(00.000*kW)                             Actual electricity power consumption (+P)
+  OBIS_TARIFF(1, 0,  1,  8,  1, FIXED,       electricityUsedTariff1, electricityUsedTariff2),         // 1-0:1.8.1(000992.992*kWh) Consumption (Tariff 1, night)
+  OBIS_TARIFF(1, 0,  1,  8,  2, FIXED,       electricityUsedTariff2, electricityUsedTariff1),         // 1-0:1.8.2(000560.157*kWh) Consumption (Tariff 2, day)
+  OBIS_VALUE (1, 0,  2,  7,  0, POWER,       actualElectricityPowerRet),  // 1-0:2.7.0(00.000*kW)                             Actual electricity power injection (-P)
+  OBIS_TARIFF(1, 0,  2,  8,  1, FIXED,       electricityReturnedTariff1, electricityReturnedTariff2), // 1-0:2.8.1(000348.890*kWh) Injection (Tariff 1, night)
+  OBIS_TARIFF(1, 0,  2,  8,  2, FIXED,       electricityReturnedTariff2, electricityReturnedTariff1), // 1-0:2.8.2(000859.885*kWh) Injection (Tariff 2, day)
+  OBIS_VALUE (1, 0, 21,  7,  0, POWER,       activePowerL1P),             // 1-0:21.7.0(00.000*kW)                            Instantaneous active power L1 (+P)
+  OBIS_VALUE (1, 0, 22,  7,  0, POWER,       activePowerL1NP),            // 1-0:22.7.0(00.000*kW)                            Instantaneous active power L1 (-P)
+  OBIS_IGNORE(1, 0, 31,  4,  0),                                           // 1-0:31.4.0(999.99*A)                             Fuse supervision threshold (L1) in A
+  OBIS_FIELD (1, 0, 31,  7,  0, FIXED,       instantaneousCurrentL1),     // 1-0:31.7.0(000.00*A)                             Instantaneous current L1 in A
+  OBIS_VALUE (1, 0, 32,  7,  0, VOLTAGE,     instantaneousVoltageL1),     // 1-0:32.7.0(232.0*V)                              Instantaneous voltage L1 in V
+  OBIS_FIELD (1, 0, 32, 32,  0, INTEGER,     numberVoltageSagsL1),        // 1-0:32.32.0(00000)                               Number of voltage sags in phase L1
+  OBIS_FIELD (1, 0, 32, 36,  0, INTEGER,     numberVoltageSwellsL1),      // 1-0:32.36.0(00000)                               Number of voltage swells in phase L1
+  OBIS_VALUE (1, 0, 41,  7,  0, POWER,       activePowerL2P),             // 1-0:41.7.0(00.000*kW)                            Instantaneous active power L2 (+P)
+  OBIS_VALUE (1, 0, 42,  7,  0, POWER,       activePowerL2NP),            // 1-0:42.7.0(00.000*kW)                            Instantaneous active power L2 (-P)
+  OBIS_FIELD (1, 0, 51,  7,  0, FIXED,       instantaneousCurrentL2),     // 1-0:51.7.0(000.00*A)                             Instantaneous current L2 in A
+  OBIS_VALUE (1, 0, 52,  7,  0, VOLTAGE,     instantaneousVoltageL2),     // 1-0:52.7.0(232.0*V)                              Instantaneous voltage L2 in V
+  OBIS_FIELD (1, 0, 52, 32,  0, INTEGER,     numberVoltageSagsL2),        // 1-0:52.32.0(00000)                               Number of voltage sags in phase L2
+  OBIS_FIELD (1, 0, 52, 36,  0, INTEGER,     numberVoltageSwellsL2),      // 1-0:52.36.0(00000)                               Number of voltage swells in phase L2
+  OBIS_VALUE (1, 0, 61,  7,  0, POWER,       activePowerL3P),             // 1-0:61.7.0(00.000*kW)                            Instantaneous active power L3 (+P)
+  OBIS_VALUE (1, 0, 62,  7,  0, POWER,       activePowerL3NP),            // 1-0:62.7.0(00.000*kW)                            Instantaneous active power L3 (-P)
+  OBIS_FIELD (1, 0, 71,  7,  0, FIXED,       instantaneousCurrentL3),     // 1-0:71.7.0(000.00*A)                             Instantaneous current L3 in A
+  OBIS_VALUE (1, 0, 72,  7,  0, VOLTAGE,     instantaneousVoltageL3),     // 1-0:72.7.0(232.0*V)                              Instantaneous voltage L3 in V
+  OBIS_FIELD (1, 0, 72, 32,  0, INTEGER,     numberVoltageSagsL3),        // 1-0:72.32.0(00000)                               Number of voltage sags in phase L3
+  OBIS_FIELD (1, 0, 72, 36,  0, INTEGER,     numberVoltageSwellsL3),      // 1-0:72.36.0(00000)                               Number of voltage swells in phase L3
+  OBIS_IGNORE(1, 0, 94, 32,  1),                                           // 1-0:94.32.1(400)                                 230: 3x230 grid, 400: 3N400V grid
+  OBIS_FIELD (1, 0, 99, 97,  0, RAW,         longPowerFailuresLog),       // 1-0:99.97.0(6)(0-0:96.7.19)(...)                 Power failure event log (long power failures)
+  OBIS_VERSION(1, 3,  0,  2,  8),                                          // 1-3:0.2.8(42)                                    Version information
+};
+
+#define OBISFIELDSCOUNT (sizeof(OBISFields) / sizeof(OBISFields[0]))
+#define OBISUNKNOWN 0xFF // index of a code that is not in OBISFields
+static_assert(OBISFIELDSCOUNT < OBISUNKNOWN, "OBISFields index must fit in 8 bits");
+
+/// @brief Check at compile time that the table is sorted (needed for the binary search)
+static constexpr bool OBISFieldsSorted(size_t i = 1)
+{
+  return (i >= OBISFIELDSCOUNT) || ((OBISFields[i - 1].key < OBISFields[i].key) && OBISFieldsSorted(i + 1));
+}
+static_assert(OBISFieldsSorted(), "OBISFields must be sorted on key without duplicate");
+static_assert(static_cast<uint8_t>(P1Reader::Field::COUNT) <= 64, "DataP1::changed has only 64 bits");
+
+/// @brief Read the reference A-B:C.D.E of an OBIS line
+/// @param id Reference of the line
+/// @param key Receives the OBISKey() of the reference
+/// @return false if the reference is not a valid DSMR reference
+static bool ParseOBISKey(const P1Span &id, uint32_t &key)
+{
+  uint16_t parts[5] = {};
+  uint8_t count = 0;
+  bool inNumber = false;
+
+  for (uint16_t i = 0; i < id.len; i++) {
+    char c = id.ptr[i];
+    if (isDigit(c)) {
+      if (!inNumber) {
+        if (count == 5) {
+          return false;
+        }
+        inNumber = true;
+        count++;
+      }
+      parts[count - 1] = parts[count - 1] * 10 + (c - '0');
+      if (parts[count - 1] > 255) {
+        return false;
+      }
     }
     else {
-      value += (char)telegram[i];
-      trailingZero = false;
-      i++;
+      inNumber = false;
     }
   }
-  return value;
+
+  // B = MBUS is the channel wildcard of OBISFields, a meter never sends it
+  if ((count != 5) || (parts[0] > 0x0F) || (parts[1] >= MBUS)) {
+    return false;
+  }
+
+  key = OBISKey(parts[0], parts[1], parts[2], parts[3], parts[4]);
+  return true;
 }
 
-String P1Reader::readUntilStar(int start, int end)
+/// @brief Binary search of an OBIS code in OBISFields
+/// @param key OBISKey() to find
+/// @return index of the code in OBISFields, OBISUNKNOWN if the code is unknown
+static uint8_t FindOBISField(uint32_t key)
 {
-  String value = "";
-  int i = start + 1;
-  bool trailingZero = true;
-  while ((telegram[i] != '*') && (i < end)) {
-    if (trailingZero && telegram[i] != '0') {
-      trailingZero = false;
+  size_t low = 0;
+  size_t high = OBISFIELDSCOUNT;
+
+  while (low < high) {
+    size_t middle = (low + high) / 2;
+    uint32_t current = pgm_read_dword(&OBISFields[middle].key);
+
+    if (current == key) {
+      return middle;
     }
-    if ((telegram[i] == '0') && (telegram[i + 1] == '.')) {
-      // value += (char)telegram[i];
-      trailingZero = false;
+
+    if (current < key) {
+      low = middle + 1;
     }
-    if (!trailingZero) {
-      value += (char)telegram[i];
+    else {
+      high = middle;
     }
-    i++;
   }
-  return value;
+  return OBISUNKNOWN;
 }
 
-String P1Reader::readBetweenDoubleParenthesis(int start, int end)
+/// @brief Find the code of a line in OBISFields, the codes 0-1 to 0-4 are found on their M-Bus entry
+/// @param id OBIS reference of the line
+/// @param channel Receives the M-Bus channel of the line (0 if it is not an M-Bus code)
+/// @return index of the code in OBISFields, OBISUNKNOWN if the code is unknown
+static uint8_t LookupOBISLine(const P1Span &id, uint8_t &channel)
 {
-  String value = "";
-  int i = start + 1;
-  while ((telegram[i] != ')') && (telegram[i + 1] != '(')) {
-    i++; // we have found the intersection of the command and data
-         // 0-1:24.2.1(231029141500W)(05446.465*m3)
+  uint32_t key;
+  channel = 0;
+
+  if (!ParseOBISKey(id, key)) {
+    return OBISUNKNOWN;
   }
-  i++;
-  value = readUntilStar(i, end);
-  return value;
+
+  uint8_t index = FindOBISField(key);
+  uint8_t b = (key >> 24) & 0x0F;
+  if ((index == OBISUNKNOWN) && ((key >> 28) == 0) && (b >= 1) && (b <= P1MBUSCOUNT)) {
+    channel = b;
+    index = FindOBISField((key & ~(0x0FUL << 24)) | ((uint32_t)MBUS << 24));
+  }
+  return index;
 }
 
-void P1Reader::OBISparser(int len)
+/// @brief Index in OBISFields of a line, predicted by the learnt datagram when possible
+/// @param id OBIS reference of the line
+/// @return index of the code in OBISFields, OBISUNKNOWN if the code is unknown
+uint8_t P1Reader::FindLine(const P1Span &id, uint8_t &channel)
 {
-  int i;
-  String value;
-  String inString = "";
-  int idx;
-
-  for (i = 0; i < len; i++) {
-    if (telegram[i] == '(') {
-      break;
+  FrameLines++;
+
+  if (TemplateCount == 0) {
+    // learning : the lines of this datagram will be the expected ones
+    uint8_t index = LookupOBISLine(id, channel);
+    if ((TemplatePos < P1TEMPLATESIZE) && (id.len <= sizeof(Template[0].id))) {
+      TemplateLine &learnt = Template[TemplatePos++];
+      memcpy(learnt.id, id.ptr, id.len);
+      learnt.len = id.len;
+      learnt.index = index;
+      learnt.channel = channel;
     }
-    if (isDigit(telegram[i])) {
-      // convert the incoming byte to a char and add it to the string:
-      inString += (char)telegram[i];
+    return index;
+  }
+
+  // fast path : the line is the one that followed the previous line in the learnt datagram
+  if ((TemplatePos < TemplateCount) && (Template[TemplatePos].len == id.len) && (memcmp(Template[TemplatePos].id, id.ptr, id.len) == 0)) {
+    TemplateHits++;
+    channel = Template[TemplatePos].channel;
+    return Template[TemplatePos++].index;
+  }
+
+  TemplateMisses++;
+  FrameMisses++;
+
+  // a line is missing or added : resynchronize on this line if it is further in the learnt datagram
+  for (uint8_t i = TemplatePos; i < TemplateCount; i++) {
+    if ((Template[i].len == id.len) && (memcmp(Template[i].id, id.ptr, id.len) == 0)) {
+      TemplatePos = i + 1;
+      channel = Template[i].channel;
+      return Template[i].index;
     }
   }
 
-  idx = inString.toInt();
-  
-  switch (idx)
+  return LookupOBISLine(id, channel);
+}
+
+void P1Reader::OBISparser(const char *text, int len)
+{
+  OBISTokenizer line;
+  OBISGroup group;
+  OBISField field;
+
+  if (!line.begin(text, len)) {
+    return; // no value in this line
+  }
+
+  uint8_t channel;
+  uint8_t index = FindLine(line.id, channel);
+  if (index == OBISUNKNOWN) {
+    MainSendDebugPrintf("[P1] Unrecognized line : %.*s", line.id.len, line.id.ptr);
+    return;
+  }
+  memcpy_P(&field, &OBISFields[index], sizeof(field));
+
+  if (field.kind == OBISKind::IGNORE) {
+    return;
+  }
+
+  P1Span groups = line.rest();
+  if (!line.next(group)) {
+    return;
+  }
+
+  bool inverted = field.tariff && conf.InverseHigh_1_2_Tarif;
+  uint8_t *target = reinterpret_cast<uint8_t *>(&BackBuffer()) + (inverted ? field.offsetInverted : field.offset);
+  Field id = (channel != 0) ? MBusField(channel) : (inverted ? field.fieldInverted : field.field);
+  bool changed = false;
+
+  int64_t deadband = 0; // in thousandths, like FixedValue
+  if (field.deadband == OBISDeadband::POWER) {
+    deadband = conf.deadbandPower; // W of a kW value
+  }
+  else if (field.deadband == OBISDeadband::VOLTAGE) {
+    deadband = conf.deadbandVoltage * 100; // mV of a V value
+  }
+
+  switch (field.kind)
   {
-  case 0:
-    break;
-  case 9614:    // 0-0:96.1.4(50221)                                Version information
-    readFirstParenthesisVal(i, len).toCharArray(DataReaded.P1version, sizeof(DataReaded.P1version));
-    break;
-  case 1094321: // 1-0:94.32.1(400)                                 (230: 3x230 grid, 400: 3N400V grid)
-    break;
-  case 9611:    // 0-0:96.1.1(3153414733313031303231363035)         Equipment identifier electricity
-    readFirstParenthesisVal(i, len).toCharArray(DataReaded.equipmentId, sizeof(DataReaded.equipmentId));
+  case OBISKind::FIXED:
+    StoreFixed(id, deadband, *reinterpret_cast<FixedValue *>(target), FixedValue(group.value));
     break;
-  case 9612:    // 0-0:96.1.2(353431343430303132333435363738393030) EAN code
-    break;
-  case 100:     // 0-0:1.0.0(200512135409S) DateTime YYMMDDhhmm
-    readFirstParenthesisVal(i, len).toCharArray(DataReaded.P1timestamp, sizeof(DataReaded.P1timestamp));
-    break;
-	
-  case 10181: // 1-0:1.8.1(000992.992*kWh)                          Meter reading electricity consumption (Tariff 1, night) in 0.001kWh
-    if (!conf.InverseHigh_1_2_Tarif) {
-      DataReaded.electricityUsedTariff1 = FixedValue(readUntilStar(i, len));
-    } else {
-      DataReaded.electricityUsedTariff2 = FixedValue(readUntilStar(i, len));
+  case OBISKind::TIMESTAMPED:
+    if (line.next(group)) {
+      StoreFixed(id, deadband, *reinterpret_cast<FixedValue *>(target), FixedValue(group.value));
     }
     break;
-  case 10182: // 1-0:1.8.2(000560.157*kWh)                          Meter reading electricity consumption (Tariff 2, day) in 0.001kWh
-    if (!conf.InverseHigh_1_2_Tarif){
-      DataReaded.electricityUsedTariff2 = FixedValue(readUntilStar(i, len));
-    } else {
-      DataReaded.electricityUsedTariff1 = FixedValue(readUntilStar(i, len));
+  case OBISKind::INTEGER: {
+    uint32_t value = group.value.toUInt();
+    if (inverted) {
+      value = (value == 1) ? 2 : 1; // tariff indicator
     }
+    changed = (*reinterpret_cast<uint32_t *>(target) != value);
+    *reinterpret_cast<uint32_t *>(target) = value;
     break;
-  case 10281: // 1-0:2.8.1(000348.890*kWh)                          Meter reading electricity injection (Tariff 1, night) in 0.001kWh
-    if (!conf.InverseHigh_1_2_Tarif) {
-      DataReaded.electricityReturnedTariff1 = FixedValue(readUntilStar(i, len));
-    } else {
-      DataReaded.electricityReturnedTariff2 = FixedValue(readUntilStar(i, len));
-    }
-    break;
-  case 10282: // 1-0:2.8.2(000859.885*kWh)                          Meter reading electricity injection (Tariff 2, day) in 0.001kWh
-    if (!conf.InverseHigh_1_2_Tarif) {
-      DataReaded.electricityReturnedTariff2 = FixedValue(readUntilStar(i, len));
-    } else {
-      DataReaded.electricityReturnedTariff1 = FixedValue(readUntilStar(i, len));
-    }
+  }
+  case OBISKind::DATETIME:
+    BackBuffer().P1epoch = TimestampToEpoch(group.value);
+    // fall through - the text is kept too
+  case OBISKind::TEXT:
+  case OBISKind::RAW: {
+    P1Span text = (field.kind == OBISKind::RAW) ? groups : group.value;
+    char *dest = reinterpret_cast<char *>(target);
+    size_t count = (text.len < field.size - 1) ? text.len : field.size - 1;
+    changed = (dest[count] != '\0') || (strncmp(dest, text.ptr, count) != 0);
+    text.copyTo(dest, field.size);
     break;
-		
-  case 96140: // 0-0:96.0(0001)                                     Tariff indicator (electricity (1: High/normal, 2: low))
-    DataReaded.tariffIndicatorElectricity = readFirstParenthesisVal(i, len).toInt();
-    if (conf.InverseHigh_1_2_Tarif) {
-      if (DataReaded.tariffIndicatorElectricity == 1) {
-        DataReaded.tariffIndicatorElectricity = 2;
-      } else {
-        DataReaded.tariffIndicatorElectricity = 1;
-      }
+  }
+  case OBISKind::PEAKS:
+    changed = StorePeaks(groups);
+    break;
+  case OBISKind::MBUSTYPE:
+  case OBISKind::MBUSID:
+  case OBISKind::MBUSREADING:
+  case OBISKind::MBUSBREAKER:
+    if ((channel < 1) || (channel > P1MBUSCOUNT)) {
+      return;
     }
+    changed = StoreMBus(BackBuffer().mbus[channel - 1], field.kind, line, group);
     break;
-  case 10140: // 1-0:1.4.0(02.351*kW)                               Current average demand active energy import in kW
-    DataReaded.activeEnergyActual = FixedValue(readUntilStar(i, len));
-    break;
-  case 10160: // 1-0:1.6.0(200509134558S)(02.589*kW)                Maximum demand Active energy import of the current month in kW
-    DataReaded.activeEnergyMaximumOfThisMonth = FixedValue(readUntilStar(i, len));
-	  break;	
-  case 9810:  // 0-0:98.1.0(3)(1-0:1.6.0)(1-0:1.6.0)(200501000000S)(200423192538S)(03.695*kW)(200401000000S)(200305122139S)(05.980*kW)(200301000000S)(200210035421W)(04.318*kW) Maximum demand history (last 13 months) in kW
-    //TODO
-    break;
-  case 10170: // 1-0:1.7.0(00.000*kW)                               Actual electricity power consumption (+P) in 0.001kWh
-    DataReaded.actualElectricityPowerDeli = FixedValue(readUntilStar(i, len));
-    break;
-  case 10270: // 1-0:2.7.0(00.000*kW)                               Actual electricity power injection (-P) in 0.001kWh
-    DataReaded.actualElectricityPowerRet = FixedValue(readUntilStar(i, len));
-    break;
-  case 102170:  // 1-0:21.7.0(00.000*kW)                            Instantaneous active power L1(+P) in 0.001kWh
-    DataReaded.activePowerL1P = FixedValue(readUntilStar(i, len));
-    break;
-  case 104170:  // 1-0:41.7.0(00.000*kW)                            Instantaneous active power L2(+P) in 0.001kWh
-    DataReaded.activePowerL2P = FixedValue(readUntilStar(i, len));
-    break;
-  case 106170:  // 1-0:61.7.0(00.000*kW)                            Instantaneous active power L3(+P) in 0.001kWh
-    DataReaded.activePowerL3P = FixedValue(readUntilStar(i, len));
-    break;
-  case 102270:  // 1-0:22.7.0(00.000*kW)                            Instantaneous active power L1(-P) in 0.001kWh
-    DataReaded.activePowerL1NP = FixedValue(readUntilStar(i, len));
-    break;
-  case 104270:  // 1-0:42.7.0(00.000*kW)                            Instantaneous active power L2(-P) in 0.001kWh
-    DataReaded.activePowerL2NP = FixedValue(readUntilStar(i, len));
-    break;
-  case 106270:  // 1-0:62.7.0(00.000*kW)                            Instantaneous active power L3(-P) in 0.001kWh
-    DataReaded.activePowerL3NP = FixedValue(readUntilStar(i, len));
-    break;
-  case 103270:  // 1-0:32.7.0(232.0*V)                              Instantaneous voltage L1 in V
-    DataReaded.instantaneousVoltageL1 = FixedValue(readUntilStar(i, len));
-    break;
-  case 105270:  // 1-0:52.7.0(232.0*V)                              Instantaneous voltage L2 in V
-    DataReaded.instantaneousVoltageL2 = FixedValue(readUntilStar(i, len));
-    break;
-  case 107270:  // 1-0:72.7.0(232.0*V)                              Instantaneous voltage L3 in V
-    DataReaded.instantaneousVoltageL3 = FixedValue(readUntilStar(i, len));
-    break;
-  case 103170:  // 1-0:31.7.0(000.00*A)                             Instantaneous current L1 in A
-    DataReaded.instantaneousCurrentL1 = FixedValue(readUntilStar(i, len));
-    break;
-  case 105170:  // 1-0:51.7.0(000.00*A)                             Instantaneous current L2 in A
-    DataReaded.instantaneousCurrentL2 = FixedValue(readUntilStar(i, len));
-    break;
-  case 107170:  // 1-0:71.7.0(000.00*A)                             Instantaneous current L3 in A
-    DataReaded.instantaneousCurrentL3 = FixedValue(readUntilStar(i, len));
-    break;
-  case 96310:   // 0-0:96.3.10(1)                                   Breaker state (0: Disconnected, 1: Connected, 2: Ready_for_reconnection)	
-	  break;
-  case 1700:    // 0-0:17.0.0(99.999*kW)                            Limiter threshold in kW (0-99.998: threshold, 99.999: deactivated)
-    break;	
-  case 103140:  // 1-0:31.4.0(999.99*A)                             Fuse supervision threshold (L1) in A (0-99.998: threshold, 99.999: deactivated)
-	  break;
-  case 196310:  // 0-1:96.3.10(0)                                   Breaker state (0: Disconnected, 1: Connected, 2: Ready_for_reconnection)?	
-	  break;
-  case 296310:  // 0-2:96.3.10(0)                                   Breaker state (0: Disconnected, 1: Connected, 2: Ready_for_reconnection)?	
-	  break;
-  case 396310:  // 0-3:96.3.10(0)                                   Breaker state (0: Disconnected, 1: Connected, 2: Ready_for_reconnection)?	
-	  break;
-  case 496310:  // 0-4:96.3.10(0)                                   Breaker state (0: Disconnected, 1: Connected, 2: Ready_for_reconnection)?	
-	  break;
-  case 96130:   // 0-0:96.13.0()                                    Text message (max 1024 characters)	
-	  break;
-	
-  case 1032320: // 1-0:32.32.0                                      Aantal korte spanningsdalingen Elektriciteit in fase 1
-    DataReaded.numberVoltageSagsL1 = readFirstParenthesisVal(i, len).toInt();
-    break;
-  case 1052320: // 1-0:52.32.0                                      Aantal korte spanningsdalingen Elektriciteit in fase 2
-   DataReaded.numberVoltageSagsL2 = readFirstParenthesisVal(i, len).toInt();
-    break;
-  case 1072320: // 1-0:72.32.0                                      Aantal korte spanningsdalingen Elektriciteit in fase 3
-    DataReaded.numberVoltageSagsL3 = readFirstParenthesisVal(i, len).toInt();
-    break;
-  case 1032360: // 1-0:32.36.0(00000)                               Aantal korte spanningsstijgingen Elektriciteit in fase 1
-    DataReaded.numberVoltageSwellsL1 = readFirstParenthesisVal(i, len).toInt();
-    break;
-  case 1052360: // 1-0:52.36.0(00000)                               Aantal korte spanningsstijgingen Elektriciteit in fase 2
-    DataReaded.numberVoltageSwellsL2 = readFirstParenthesisVal(i, len).toInt();
-    break;
-  case 1072360: // 1-0:72.36.0(00000)                               Aantal korte spanningsstijgingen Elektriciteit in fase 3
-    DataReaded.numberVoltageSwellsL3 = readFirstParenthesisVal(i, len).toInt();
-    break;
-  case 96721:   // 0-0:96.7.21(00051)  Number of power failures in any phase
-    DataReaded.numberPowerFailuresAny = readFirstParenthesisVal(i, len).toInt();
-    break;
-  case 9679:    // 0-0:96.7.9(00007) Number of long power failures in any phase
-    DataReaded.numberLongPowerFailuresAny = readFirstParenthesisVal(i, len).toInt();
+  case OBISKind::DSMRVERSION:
+    DSMRVersion = (!group.value.empty() && isDigit(group.value.ptr[0])) ? group.value.ptr[0] - '0' : 0;
+    return; // not part of DataP1
+  default:
     break;
-  case 1099970: // 1-0:99.97.0(6) Power Failure Event Log (long power failures)
-    DataReaded.longPowerFailuresLog = "";
-    while (i < len)
-    {
-      DataReaded.longPowerFailuresLog += (char)telegram[i];
-      i++;
+  }
+
+  if (changed) {
+    BackBuffer().changed |= FieldBit(id);
+  }
+}
+
+/// @brief Store a line of an M-Bus device
+/// @param device Channel of the device in the back buffer
+/// @param kind Kind of the line
+/// @param line Tokenizer of the line, after its first group
+/// @param group First group of the line
+/// @return true if the device changed
+bool P1Reader::StoreMBus(MBusP1 &device, OBISKind kind, OBISTokenizer &line, OBISGroup &group)
+{
+  switch (kind)
+  {
+  case OBISKind::MBUSTYPE: {
+    uint8_t type = group.value.toUInt();
+    bool changed = (device.type != type);
+    device.type = type;
+    return changed;
+  }
+  case OBISKind::MBUSID: {
+    // kept as sent, in hexadecimal, like the identifier of the electricity meter
+    size_t count = (group.value.len < sizeof(device.id) - 1) ? group.value.len : sizeof(device.id) - 1;
+    bool changed = (device.id[count] != '\0') || (strncmp(device.id, group.value.ptr, count) != 0);
+    group.value.copyTo(device.id, sizeof(device.id));
+    return changed;
+  }
+  case OBISKind::MBUSREADING: {
+    P1Span time = group.value;
+    if (!line.next(group)) {
+      return false;
     }
-    break;
+    FixedValue value(group.value);
+    uint32_t epoch = TimestampToEpoch(time);
+    bool changed = (device.value.int_val() != value.int_val()) || (device.epoch != epoch);
+    device.value = value;
+    device.epoch = epoch;
+    return changed;
+  }
+  case OBISKind::MBUSBREAKER: {
+    while (line.next(group)) {
+      // the state is the last group
+    }
+    uint8_t breaker = group.value.toUInt();
+    bool changed = (device.breaker != breaker);
+    device.breaker = breaker;
+    return changed;
+  }
+  default:
+    return false;
+  }
+}
 
+/// @brief Decode the maximum demand history, only if the line changed since the previous datagram
+/// @param groups All the groups of the 0-0:98.1.0 line
+/// @return true if the history changed
+bool P1Reader::StorePeaks(P1Span groups)
+{
+  DataP1 &data = BackBuffer();
 
-  case 12410:   // 0-1:24.1.0(003)                                  Device type, gas
-    break;
-  case 12420:   // 0-n:24.2.0                                       M-Bus device type, gas
-    break;
-  case 19610:   // 0-n:96.1.0                                       Equipment identifier gas
-  case 19611:   // 0-n:96.1.0(37464C4F32313139303333373333)         
-    readFirstParenthesisVal(i, len).toCharArray(DataReaded.equipmentId2, sizeof(DataReaded.equipmentId2));
-    break;
-  case 19612:   // 0-n:96.1.0(353431343430303132333435363738393030)         
-    break;	
-  case 12421:   // 0-n:24.2.1                                       Last 5-minute value (temperature converted) in m3, gas
-  case 12423:   // 0-n:24.2.3(200512134558S)(00112.384*m3)          Last 5-minute value (not temperature converted) in m3, gas
-    DataReaded.gasReceived5min = FixedValue(readBetweenDoubleParenthesis(i, len));
-    break;
-  case 12424: // 0-n:24.2.4 Breaker state, gas
-	  break;
+  uint32_t hash = 2166136261UL; // FNV-1a
+  for (uint16_t i = 0; i < groups.len; i++) {
+    hash = (hash ^ static_cast<uint8_t>(groups.ptr[i])) * 16777619UL;
+  }
+  if (hash == data.peaksHash) {
+    return false; // same months as in the previous datagram (kept by the copy of the buffer)
+  }
+  data.peaksHash = hash;
+
+  OBISTokenizer line;
+  OBISGroup group;
+  line.begin(groups.ptr, groups.len);
+  uint32_t count = line.next(group) ? group.value.toUInt() : 0;
+  line.next(group); // OBIS reference of the values (1-0:1.6.0)
+  line.next(group); // OBIS reference of the times (1-0:1.6.0)
+
+  data.peaksCount = 0;
+  for (uint32_t i = 0; (i < count) && (data.peaksCount < P1PEAKSCOUNT); i++) {
+    OBISGroup month, time, value;
+    if (!line.next(month) || !line.next(time) || !line.next(value)) {
+      break;
+    }
+    PeakP1 &peak = data.peaks[data.peaksCount++];
+    peak.epoch = TimestampToEpoch(time.value);
+    peak.peak_mW = FixedValue(value.value).int_val() * 1000; // thousandths of kW
+  }
+  return true;
+}
 
-  case 22410:   // 0-2:24.1.0(007)                                  Device type, water
-    break;
-  case 22420:   // 0-n:24.2.0                                       M-Bus device type, water
-    break;
-  case 29610:   // 0-n:96.1.0                                       Equipment identifier water
-  case 29611:   // 0-n:96.1.1(3853414731323334353637383930)         
-    readFirstParenthesisVal(i, len).toCharArray(DataReaded.equipmentId3, sizeof(DataReaded.equipmentId3));
-    break;
-  case 29612:   // 0-n:96.1.0(353431343430303132333435363738393033)         
-    break;	
-  case 22421: // 0-n:24.2.1                                         Last 5-minute value in 0,001m3, water
-  case 22423: // 0-n:24.2.3(200512134558S)(00872.234*m3)            Last 5-minute value (not temperature converted) in m3, water
-    DataReaded.waterReceived5min = FixedValue(readBetweenDoubleParenthesis(i, len));
-    break;
-	
-	
-    
-    
-  case 96131:  //0-0:96.13.1                                        Consumer message code    
-  case 13028:  //1-3:0.2.8                                          version information
-  case 2410:   //0-n:24.1.0                                         Equipment identifier  
-    //ignore line :-)
-    break;
-  default:
-    MainSendDebugPrintf("[P1] Unrecognized line : %s", inString);
-    break;
+/// @brief Store a FixedValue and flag it as changed if it moved beyond its deadband since its last change
+/// @param field Value of DataP1
+/// @param deadband Largest variation ignored (in thousandths, 0 = any variation is a change)
+/// @param target Member of the back buffer
+/// @param value New value
+void P1Reader::StoreFixed(Field field, int64_t deadband, FixedValue &target, FixedValue value)
+{
+  target = value;
+
+  uint8_t index = static_cast<uint8_t>(field);
+  int64_t delta = value.int_val() - ChangeReference[index];
+  if ((delta > deadband) || (delta < -deadband)) {
+    ReferenceCandidate[index] = value.int_val(); // kept only if the CRC of the datagram is valid
+    ReferenceMoved |= FieldBit(field);
+    BackBuffer().changed |= FieldBit(field);
+  }
+}
+
+/// @brief Convert a DSMR timestamp (YYMMDDhhmmssX) to a UTC epoch. The meter gives its local time,
+/// X tells if it is the summer (S, UTC+2) or the winter (W, UTC+1) time.
+/// @param timestamp Text of the timestamp
+/// @return seconds since 1970-01-01 UTC, 0 if the timestamp is not valid
+uint32_t P1Reader::TimestampToEpoch(P1Span timestamp)
+{
+  uint8_t parts[6]; // YY MM DD hh mm ss
+
+  if (timestamp.len < 12) {
+    return 0;
+  }
+  for (uint8_t i = 0; i < 6; i++) {
+    char high = timestamp.ptr[i * 2];
+    char low = timestamp.ptr[i * 2 + 1];
+    if (!isDigit(high) || !isDigit(low)) {
+      return 0;
+    }
+    parts[i] = (high - '0') * 10 + (low - '0');
+  }
+
+  uint8_t month = parts[1];
+  if ((month < 1) || (month > 12) || (parts[2] < 1) || (parts[2] > 31)) {
+    return 0;
   }
 
-  // clear the string for new input:
-  inString = "";
+  // days since 1970-01-01 of the civil date (the year starts in March to put the leap day at its end)
+  uint32_t year = 2000 + parts[0] - ((month <= 2) ? 1 : 0);
+  uint32_t era = year / 400;
+  uint32_t yearOfEra = year - era * 400;
+  uint32_t dayOfYear = (153 * ((month > 2) ? month - 3 : month + 9) + 2) / 5 + parts[2] - 1;
+  uint32_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+  uint32_t days = era * 146097 + dayOfEra - 719468;
+
+  bool summer = (timestamp.len > 12) && (timestamp.ptr[12] == 'S');
+  return days * 86400UL + parts[3] * 3600UL + parts[4] * 60UL + parts[5] - (summer ? 7200 : 3600);
 }
 
 unsigned long P1Reader::GetnextUpdateTime()
@@ -433,6 +767,19 @@ unsigned long P1Reader::GetnextUpdateTime()
 
 void P1Reader::DoMe()
 {
+  unsigned long elapsed = millis() - RateStart;
+  if (elapsed >= P1RATEPERIOD) {
+    FramesPerMin = (uint64_t)(FramesAccepted - RateFrames) * 60000 / elapsed;
+    BytesPerSec = (uint64_t)(RxBytes - RateBytes) * 1000 / elapsed;
+    RateStart = millis();
+    RateFrames = FramesAccepted;
+    RateBytes = RxBytes;
+  }
+
+  if ((Source == &Replay) && !Replay.IsOpen()) {
+    StopReplay(); // end of the file, back to the meter
+  }
+
   if ((millis() > nextUpdateTime) && (state == State::DISABLED)) {
     RTS_on();
   }
@@ -454,6 +801,31 @@ bool P1Reader::CheckTimeout()
   return false;
 }
 
+/// @brief Prepare the next reading and notify the listeners once a datagram is complete
+void P1Reader::EndOfDatagram()
+{
+  bool valid = (state == State::DONE);
+
+  if (conf.ContinuousRead) {
+    // Data Request stays on, the next datagram comes by itself : no blocking blink here
+    if (valid) {
+      digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
+    }
+    state = State::WAITING;
+    TimeOutRead = millis() + (2 * P1TIMEOUTREAD); // DSMR 4 meters only send every 10s
+  }
+  else {
+    if (valid && (Source == &Uart)) {
+      blink(1, 400); // blocking, would slow down a replay
+    }
+    RTS_off(); // wait for the next interval
+  }
+
+  if (valid) {
+    TriggerCallbacks();
+  }
+}
+
 void P1Reader::readTelegram()
 {
   if ((state != State::WAITING) && (state != State::READING)) {
@@ -464,24 +836,73 @@ void P1Reader::readTelegram()
     return;
   }
 
-  if (Serial.available()) {
-    memset(telegram, 0, sizeof(telegram));
-    while (Serial.available()) {
-      if (CheckTimeout()) {
-        return;
+  int available = Source->available();
+  bool uart = (Source == &Uart); // a replay is not counted in the statistics of the P1 port
+  if (uart && ((uint32_t)available > RxHighWater)) {
+    RxHighWater = available;
+  }
+
+  if (Source->hasOverrun()) {
+    RxOverruns++;
+    MainSendDebugPrintf("[P1] UART buffer overrun (%u)", RxOverruns);
+  }
+
+  // Only what is already in the UART buffer: never wait for the end of a line
+  char *frame = BackFrame();
+  while (available-- > 0) {
+    int c = Source->read();
+    if (c < 0) {
+      break;
+    }
+    if (uart) {
+      RxBytes++;
+    }
+
+    // the bytes are stored once, after the lines of the datagram already received
+    if (FrameLength + LineLength < P1FRAMESIZE - 1) {
+      frame[FrameLength + LineLength++] = c;
+    }
+    else {
+      if (state == State::READING) {
+        MainSendDebug("[P1] Buffer overflow ?");
+        state = State::FAULT;
+        EndOfDatagram();
+        if (state == State::DISABLED) {
+          return;
+        }
       }
+      FrameLength = 0; // the rest of this datagram is dropped until the next '/'
+      LineLength = 0;
+      continue;
+    }
 
-      int len = Serial.readBytesUntil('\n', telegram, sizeof(telegram)-2);
-      telegram[len] = '\n';
-      telegram[len + 1] = 0;
-      
-      decodeTelegram(len + 1);
+    if (c != '\n') {
+      continue;
+    }
+
+    char *line = frame + FrameLength;
+    line[LineLength] = 0;
+    uint32_t start = micros();
+    decodeTelegram(line, LineLength);
+    uint32_t spent = micros() - start;
+    LineLength = 0;
 
-      if (state == State::DONE) {
-        blink(1, 400);
-        RTS_off();
-        TriggerCallbacks();
+    if (spent > LineTimeMax) {
+      LineTimeMax = spent;
+    }
+    if (state != State::WAITING) {
+      FrameDecodeTime += spent;
+    }
+    if (state == State::DONE) {
+      DecodeTime = FrameDecodeTime;
+    }
+
+    if ((state == State::DONE) || (state == State::FAULT)) {
+      EndOfDatagram();
+      if (state == State::DISABLED) {
+        return;
       }
+      frame = BackFrame(); // the frames have been swapped if the datagram was valid
     }
   }
 }
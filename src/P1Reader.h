@@ -26,11 +26,27 @@
 #define P1READER_H
 
 #include <Arduino.h>
+#include <ArduinoJson.h>
 #include "GlobalVar.h"
 #include "Debug.h"
+#include "OBISTokenizer.h"
+#include "P1Source.h"
 
-#define MAXLINELENGTH 1037 // 0-0:96.13.0 has a maximum lenght of 1024 chars + 11 of its identifier + end line (2char)
+#define P1FRAMESIZE 2048 // largest datagram kept, 0-0:96.13.0 alone can take 1024 chars
 #define P1TIMEOUTREAD 10000
+#define FIXEDVALUESIZE 24 // longest FixedValue::toChars() : sign, 19 digits, dot and null char
+#define FIXEDVALUEMAX 1000000000000000LL // digits kept by FixedValue : 15, so that the value in thousandths fits in an int64_t
+#define P1LOGSIZE 200 // raw groups of 1-0:99.97.0 (power failure event log)
+#define P1PEAKSCOUNT 13 // months in 0-0:98.1.0 (maximum demand history)
+#define P1MBUSCOUNT 4 // M-Bus channels (0-1 to 0-4)
+#define P1MBUSIDSIZE 97 // identifier of an M-Bus device (0-n:96.1.0), 96 hexadecimal chars at most with the null char
+#define MBUS_GAS 3   // device types of 0-n:24.1.0
+#define MBUS_HEAT 4
+#define MBUS_WATER 7
+#define P1TEMPLATESIZE 48 // lines of the learnt datagram (a Siconia sends 36 lines with values)
+#define P1RATEPERIOD 60000 // ms of the window of FramesPerMin and BytesPerSec
+
+enum class OBISKind : uint8_t; // kind of line of the OBIS table (P1Reader.cpp)
 
 enum class State {
   DISABLED,
@@ -47,40 +63,166 @@ public:
   unsigned long LastSample = 0;
   explicit P1Reader(settings &currentConf);
   unsigned long GetnextUpdateTime();
-  char telegram[MAXLINELENGTH] = {}; // holds a single line of the datagram
-  String datagram;                   // holds entire datagram for raw output
   String meterName = "";
   bool dataEnd = false; // signals that we have found the end char in the data (!)
+  uint32_t FramesAccepted = 0; // datagrams with a valid CRC (or without CRC for DSMR < 4)
+  uint32_t FramesRejected = 0; // datagrams dropped because of a wrong or missing CRC
+  uint32_t RxHighWater = 0;    // highest number of bytes waiting in the UART buffer
+  uint32_t RxOverruns = 0;     // number of times the UART buffer was full (bytes lost)
+  uint32_t RxBytes = 0;        // bytes read on the P1 port since the boot
+  uint32_t LineTimeMax = 0;    // longest decoding of a single line (us)
+  uint32_t DecodeTime = 0;     // time spent decoding the last valid datagram (us), waiting for the bytes not included
+  uint32_t TemplateHits = 0;   // lines found at the place predicted by the learnt datagram
+  uint32_t TemplateMisses = 0; // lines that needed a lookup in the OBIS table
+  uint32_t FramesPerMin = 0;   // datagrams accepted during the last P1RATEPERIOD, the counters above are since the boot
+  uint32_t BytesPerSec = 0;    // bytes read on the P1 port per second during the last P1RATEPERIOD
   void DoMe();
   void readTelegram();
   void ResetnextUpdateTime();
+  /// @brief Read every seconds instead of conf.interval for a while (a dashboard is open)
+  /// @param seconds New interval, 0 to come back to conf.interval now
+  /// @param duration ms before coming back to conf.interval
+  void SetIntervalOverride(unsigned int seconds, unsigned long duration);
+  /// @brief Interval given by SetIntervalOverride(), 0 if none or expired
+  unsigned int GetIntervalOverride();
+
+  /// @brief Read the datagrams from a file instead of the meter, see P1FileSource::Open()
+  bool StartReplay(const char *path, uint16_t speed);
+  /// @brief Go back to the datagrams of the meter
+  void StopReplay();
+  bool IsReplaying() { return Replay.IsOpen(); }
 
-  /// @brief value that is parsed as a three-decimal float, but stored as an
-  // integer (by multiplying by 1000). Supports val() (or implicit cast to
-  // float) to get the original value, and int_val() to get the more
-  // efficient integer value. The unit() and int_unit() methods on
-  // FixedField return the corresponding units for these values.
+  /// @brief value that is parsed from its decimal text (000992.992) and stored as an
+  // exact 64-bit integer in thousandths of its unit (Wh for kWh, W for kW, mV for V,
+  // dm3 for m3). int_val() gives this integer, val() a float conversion for display,
+  // and toChars() formats it with three decimals without any float operation.
   struct FixedValue
   {
     FixedValue() = default;
-    explicit FixedValue(String value) : _value(value.toFloat() * 1000) {}
+    explicit FixedValue(P1Span value)
+    {
+      static const uint16_t scale[4] = { 1000, 100, 10, 1 };
+      int64_t result = 0;
+      uint8_t decimals = 0;
+      bool dot = false;
+      uint16_t i = ((value.len > 0) && (value.ptr[0] == '-')) ? 1 : 0;
+
+      for (; i < value.len; i++) {
+        char c = value.ptr[i];
+        if (isDigit(c)) {
+          // more than three decimals are truncated, the digits beyond FIXEDVALUEMAX too (never sent by a meter)
+          if ((decimals < 3) && (result < FIXEDVALUEMAX / 10)) {
+            result = result * 10 + (c - '0');
+            decimals += dot;
+          }
+        }
+        else if ((c == '.') && !dot) {
+          dot = true;
+        }
+        else {
+          break;
+        }
+      }
+
+      _value = result * scale[decimals];
+      if ((value.len > 0) && (value.ptr[0] == '-')) {
+        _value = -_value;
+      }
+    }
 
-    operator float() const { return _value * 0.001f; }
     float val() const { return _value * 0.001f; }
+    int64_t int_val() const { return _value; }
+
+    /// @brief Format the value with three decimals (992.992)
+    /// @param buffer Destination, FIXEDVALUESIZE chars is always enough
+    /// @param size Size of the destination
+    /// @return buffer
+    char *toChars(char *buffer, size_t size) const
+    {
+      char digits[FIXEDVALUESIZE];
+      uint8_t count = 0;
+      uint64_t magnitude = (_value < 0) ? -(uint64_t)_value : (uint64_t)_value;
+
+      while (magnitude > UINT32_MAX) { // 64-bit divisions only for the high part
+        digits[count++] = '0' + (magnitude % 10);
+        magnitude /= 10;
+      }
+
+      uint32_t low = magnitude;
+      do {
+        digits[count++] = '0' + (low % 10);
+        low /= 10;
+      } while ((low != 0) || (count < 4)); // at least 0.000
+
+      size_t pos = 0;
+      if ((_value < 0) && (pos + 1 < size)) {
+        buffer[pos++] = '-';
+      }
+      while ((count > 0) && (pos + 1 < size)) {
+        if (count == 3) {
+          buffer[pos++] = '.';
+          if (pos + 1 >= size) {
+            break;
+          }
+        }
+        buffer[pos++] = digits[--count];
+      }
+      buffer[pos] = '\0';
+      return buffer;
+    }
 
   private:
-    uint32_t _value = 0;
+    int64_t _value = 0;
+  };
+
+  /// @brief Values of DataP1, one bit each in DataP1::changed
+  enum class Field : uint8_t
+  {
+    mbus1, mbus2, mbus3, mbus4, // one per M-Bus channel
+    P1version, P1timestamp, equipmentId,
+    electricityUsedTariff1, electricityUsedTariff2, electricityReturnedTariff1, electricityReturnedTariff2,
+    tariffIndicatorElectricity, numberPowerFailuresAny, numberLongPowerFailuresAny, longPowerFailuresLog,
+    numberVoltageSagsL1, numberVoltageSagsL2, numberVoltageSagsL3,
+    numberVoltageSwellsL1, numberVoltageSwellsL2, numberVoltageSwellsL3,
+    instantaneousVoltageL1, instantaneousVoltageL2, instantaneousVoltageL3,
+    instantaneousCurrentL1, instantaneousCurrentL2, instantaneousCurrentL3,
+    activePowerL1P, activePowerL2P, activePowerL3P, activePowerL1NP, activePowerL2NP, activePowerL3NP,
+    actualElectricityPowerDeli, actualElectricityPowerRet, activeEnergyActual, activeEnergyMaximumOfThisMonth,
+    peaks,
+    COUNT
+  };
+  static constexpr uint64_t FieldBit(Field field) { return 1ULL << static_cast<uint8_t>(field); }
+  static constexpr uint64_t ALLFIELDS = (1ULL << static_cast<uint8_t>(Field::COUNT)) - 1;
+  static constexpr Field MBusField(uint8_t channel) { return static_cast<Field>(static_cast<uint8_t>(Field::mbus1) + channel - 1); }
+
+  /// @brief Device on an M-Bus channel (0-n:xx) of the meter : gas, water, heat, ...
+  struct MBusP1
+  {
+    FixedValue value;        // 0-n:24.2.1 last reading (m3, GJ, ...)
+    uint32_t epoch;          // capture time of value, seconds since 1970-01-01 UTC
+    uint8_t type;            // 0-n:24.1.0 device type (MBUS_GAS, MBUS_WATER, ...), 0 if not sent
+    uint8_t breaker;         // 0-n:24.4.0 / 0-n:96.3.10 valve or breaker state
+    char id[P1MBUSIDSIZE];   // 0-n:96.1.0 identifier, hexadecimal text as sent (like equipmentId)
+
+    bool IsPresent() const { return (type != 0) || (epoch != 0) || (id[0] != '\0'); }
+  };
+
+  /// @brief Highest average demand (15 min) of a month, from 0-0:98.1.0
+  struct PeakP1
+  {
+    uint32_t epoch;   // time of the peak, seconds since 1970-01-01 UTC
+    uint32_t peak_mW; // average power of the peak in mW
   };
 
   struct DataP1
   {
-    FixedValue gasReceived5min;
-    FixedValue waterReceived5min;
+    uint32_t sequence; // number of the datagram, incremented on each accepted datagram
+    uint64_t changed;  // FieldBit() of the values that changed (beyond their deadband) in this datagram
     char P1version[8];
     char P1timestamp[13] = "\0";
+    uint32_t P1epoch;  // P1timestamp in seconds since 1970-01-01 UTC (0 if the meter doesn't give it)
     char equipmentId[100]  = "\0";//electricity
-    char equipmentId2[100] = "\0";//gas
-    char equipmentId3[100] = "\0";//water
+    MBusP1 mbus[P1MBUSCOUNT];  // channels 1 to 4
     FixedValue electricityUsedTariff1;
     FixedValue electricityUsedTariff2;
     FixedValue electricityReturnedTariff1;
@@ -88,14 +230,13 @@ public:
     uint32_t tariffIndicatorElectricity;
     uint32_t numberPowerFailuresAny;
     uint32_t numberLongPowerFailuresAny;
-    String longPowerFailuresLog;
+    char longPowerFailuresLog[P1LOGSIZE] = "\0";
     uint32_t numberVoltageSagsL1;
     uint32_t numberVoltageSagsL2;
     uint32_t numberVoltageSagsL3;
     uint32_t numberVoltageSwellsL1;
     uint32_t numberVoltageSwellsL2;
     uint32_t numberVoltageSwellsL3;
-    String textMessage;
     FixedValue instantaneousVoltageL1;
     FixedValue instantaneousVoltageL2;
     FixedValue instantaneousVoltageL3;
@@ -112,7 +253,39 @@ public:
     FixedValue actualElectricityPowerRet;
     FixedValue activeEnergyActual;
     FixedValue activeEnergyMaximumOfThisMonth;
-  } DataReaded = {};
+    PeakP1 peaks[P1PEAKSCOUNT]; // maximum demand history, the most recent month first
+    uint8_t peaksCount;         // months in peaks
+    uint32_t peaksHash;         // hash of the 0-0:98.1.0 line that gave peaks
+
+    /// @brief Channel of the first M-Bus device of a type
+    /// @param type MBUS_GAS, MBUS_WATER, ...
+    /// @return the channel (1 to P1MBUSCOUNT), 0 if there is no such device
+    uint8_t FindMBus(uint8_t type) const
+    {
+      for (uint8_t i = 0; i < P1MBUSCOUNT; i++) {
+        if (mbus[i].type == type) {
+          return i + 1;
+        }
+      }
+      // meters that don't send 0-n:24.1.0 : gas on channel 1, water on channel 2
+      if ((type == MBUS_GAS) && (mbus[0].type == 0)) {
+        return 1;
+      }
+      if ((type == MBUS_WATER) && (mbus[1].type == 0)) {
+        return 2;
+      }
+      return 0;
+    }
+  };
+
+  /// @brief Last complete and valid datagram. It is not modified while the next one is
+  /// read (the parser writes in another buffer), so it can be used without copy.
+  const DataP1 &GetData() const { return Buffers[FrontBuffer]; }
+
+  static uint32_t TimestampToEpoch(P1Span timestamp);
+
+  /// @brief Raw text of the datagram returned by GetData(), from '/' to the end of the CRC line
+  P1Span GetRawDatagram() const { return P1Span(Arena + FrontBuffer * P1FRAMESIZE, RawLength); }
   void OnNewDatagram(std::function<void()> callback)
   {
     delegates.push_back(callback);
@@ -128,18 +301,118 @@ protected:
   }
 private:
   std::vector<std::function<void()>> delegates;
+  P1UartSource Uart;
+  P1FileSource Replay;
+  P1Source *Source = &Uart; // where readTelegram() takes its bytes
+  DataP1 Buffers[2] = {}; // one is published (front), the parser fills the other one
+  uint8_t FrontBuffer = 0;
+  DataP1 &BackBuffer() { return Buffers[FrontBuffer ^ 1]; }
+  char Arena[2 * P1FRAMESIZE] = {}; // raw text of the datagrams, same front/back split as Buffers
+  uint16_t RawLength = 0; // length of the published datagram in Arena
+  char *BackFrame() { return Arena + (FrontBuffer ^ 1) * P1FRAMESIZE; }
   settings &conf;
   unsigned long nextUpdateTime = millis() + 5000; //wait 5s before read datagram
+  unsigned int IntervalOverride = 0;     // seconds, 0 = conf.interval
+  unsigned long IntervalOverrideEnd = 0; // millis() when conf.interval comes back
   unsigned long TimeOutRead;
+  size_t FrameLength = 0; // bytes of the current datagram already in BackFrame()
+  size_t LineLength = 0; // bytes of the current line, written after the FrameLength bytes
+  uint32_t FrameDecodeTime = 0; // decoding time of the current datagram (us)
+  unsigned long RateStart = 0; // millis() at the start of the window of FramesPerMin and BytesPerSec
+  uint32_t RateFrames = 0;     // FramesAccepted at RateStart
+  uint32_t RateBytes = 0;      // RxBytes at RateStart
+  /// @brief Line of the learnt datagram : the meters always send their lines in the same order
+  struct TemplateLine
+  {
+    char id[12];   // OBIS reference as sent by the meter (ex: 1-0:1.8.1)
+    uint8_t len;   // length of id
+    uint8_t index; // in the OBIS table, OBISUNKNOWN if the reference is not known
+    uint8_t channel; // M-Bus channel, 0 if it is not an M-Bus line
+  };
+  TemplateLine Template[P1TEMPLATESIZE];
+  uint8_t TemplateCount = 0;    // lines of the learnt datagram, 0 = learn the next one
+  uint8_t TemplatePos = 0;      // next line expected in the current datagram
+  uint8_t FrameLines = 0;       // lines with values in the current datagram
+  uint8_t FrameMisses = 0;      // lines of the current datagram not at their expected place
+  uint8_t FindLine(const P1Span &id, uint8_t &channel);
+  int64_t ChangeReference[static_cast<uint8_t>(Field::COUNT)] = {}; // FixedValue at its last change, for the deadbands
+  int64_t ReferenceCandidate[static_cast<uint8_t>(Field::COUNT)] = {}; // new references of the datagram being read
+  uint64_t ReferenceMoved = 0; // FieldBit() of ReferenceCandidate to keep once the datagram is accepted
+  void StoreFixed(Field field, int64_t deadband, FixedValue &target, FixedValue value);
+  bool StorePeaks(P1Span groups);
+  bool StoreMBus(MBusP1 &device, OBISKind kind, OBISTokenizer &line, OBISGroup &group);
+  uint16_t CRC = 0; // CRC16/ARC of the current datagram, updated line by line
+  bool CRCSeen = false;    // a datagram with a valid CRC was received since boot, a missing CRC is then a cut line
+  uint8_t DSMRVersion = 0; // major version given by 1-3:0.2.8, 0 if the meter doesn't send it
+  void UpdateCRC(const char *data, int len);
+  bool CheckCRC(const char *line, int endChar, int len);
   void RTS_on();
   void RTS_off();
-  void OBISparser(int len);
-  String readFirstParenthesisVal(int start, int end);
-  String readBetweenDoubleParenthesis(int start, int end);
+  void OBISparser(const char *line, int len);
   int FindCharInArray(const char array[], char c, int len);
-  void decodeTelegram(int len);
+  void decodeTelegram(char *line, int len);
   String identifyMeter(String Name);
-  String readUntilStar(int start, int end);
   bool CheckTimeout();
+  void EndOfDatagram();
+};
+
+/// @brief Collects the changes of the datagrams for a publisher that doesn't send all of them
+class P1ChangeTracker
+{
+public:
+  /// @brief Add the changes of a new datagram
+  void Add(const P1Reader::DataP1 &data)
+  {
+    pending |= data.changed;
+  }
+
+  /// @brief Values to publish now, the collect restarts after this call
+  /// @param fullRefresh seconds between two complete reports (0 = always complete)
+  /// @return FieldBit() mask of the values to publish
+  uint64_t Take(unsigned int fullRefresh)
+  {
+    uint64_t result = pending;
+    pending = 0;
+
+    if ((fullRefresh == 0) || (LastFull == 0) || ((millis() - LastFull) >= (fullRefresh * 1000UL))) {
+      LastFull = millis();
+      return P1Reader::ALLFIELDS;
+    }
+    return result;
+  }
+
+  /// @brief Values of the last report that could not be published, part of the next one again
+  void Retry(uint64_t fields)
+  {
+    pending |= fields;
+  }
+
+private:
+  uint64_t pending = 0;
+  unsigned long LastFull = 0;
 };
+
+/// @brief Lets ArduinoJson write an M-Bus device
+inline void convertToJson(const P1Reader::MBusP1 &src, JsonVariant dst)
+{
+  dst["Type"] = src.type;
+  dst["Id"] = src.id;
+  dst["Value"] = src.value;
+  dst["Epoch"] = src.epoch;
+  dst["Breaker"] = src.breaker;
+}
+
+/// @brief Lets ArduinoJson write a month of the maximum demand history
+inline void convertToJson(const P1Reader::PeakP1 &src, JsonVariant dst)
+{
+  dst["Epoch"] = src.epoch;
+  dst["mW"] = src.peak_mW;
+}
+
+/// @brief Lets ArduinoJson write a FixedValue as a number with three decimals, without float
+inline void convertToJson(const P1Reader::FixedValue &src, JsonVariant dst)
+{
+  char buffer[FIXEDVALUESIZE];
+  dst.set(serialized(src.toChars(buffer, sizeof(buffer))));
+}
 #endif
\ No newline at end of file
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2025 Jean-Pierre Sneyers
+ * Source : https://github.com/narfight/P1-wifi-gateway
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additionally, please note that the original source code of this file
+ * may contain portions of code derived from (or inspired by)
+ * previous works by:
+ *
+ * Ronald Leenes (https://github.com/romix123/P1-wifi-gateway and http://esp8266thingies.nl)
+ */
+
+
+#include "P1Source.h"
+#include "Debug.h"
+
+void P1UartSource::begin()
+{
+  Serial.setRxBufferSize(P1RXBUFFERSIZE); // filled by the UART interrupt, whatever loop() is doing
+  //Serial.begin(SERIALSPEED);
+  Serial.begin(SERIALSPEED, SERIAL_8N1, SERIAL_FULL, 1, true);
+}
+
+void P1UartSource::Request(bool on)
+{
+  if (on) {
+    digitalWrite(OE, LOW); // enable buffer
+    digitalWrite(DR, HIGH); // turn on Data Request
+  }
+  else {
+    digitalWrite(DR, LOW); // turn off Data Request
+    digitalWrite(OE, HIGH); // put buffer in Tristate mode
+  }
+}
+
+bool P1FileSource::Open(const char *path, uint16_t speed)
+{
+  Close();
+
+  Replay = LittleFS.open(path, "r");
+  if (!Replay) {
+    MainSendDebugPrintf("[P1] Can't open %s", path);
+    return false;
+  }
+
+  Opened = true;
+  Speed = speed;
+  Replayed = 0;
+  DatagramLeft = 0;
+  NextDatagram = millis();
+  MainSendDebugPrintf("[P1] Replay of %s (speed %u)", path, speed);
+  return true;
+}
+
+void P1FileSource::Close()
+{
+  if (Opened) {
+    Replay.close();
+    Opened = false;
+    MainSendDebugPrintf("[P1] End of the replay, %u datagrams", Replayed);
+  }
+}
+
+/// @brief Length of the datagram at the current position of the file, up to the end of its CRC line
+size_t P1FileSource::FindDatagramEnd()
+{
+  size_t start = Replay.position();
+  size_t length = 0;
+  bool endLine = false;
+  int c;
+
+  while ((c = Replay.read()) >= 0) {
+    length++;
+    if (c == '!') {
+      endLine = true;
+    }
+    else if (endLine && (c == '\n')) {
+      break;
+    }
+  }
+
+  Replay.seek(start);
+  return length;
+}
+
+int P1FileSource::available()
+{
+  if (!Opened) {
+    return 0;
+  }
+
+  if (DatagramLeft == 0) {
+    // the replay clock gives the next datagram only if the meter is asked for it
+    if (!Requested || ((long)(millis() - NextDatagram) < 0)) {
+      return 0;
+    }
+
+    DatagramLeft = FindDatagramEnd();
+    if (DatagramLeft == 0) {
+      Close(); // end of the file
+      return 0;
+    }
+
+    Replayed++;
+    NextDatagram += (Speed == 0) ? 0 : (P1REPLAYPERIOD / Speed);
+    if ((Speed == 0) || ((long)(millis() - NextDatagram) > P1REPLAYPERIOD)) {
+      NextDatagram = millis(); // too late, don't try to catch up
+    }
+  }
+
+  return DatagramLeft;
+}
+
+int P1FileSource::read()
+{
+  if (available() == 0) {
+    return -1;
+  }
+  DatagramLeft--;
+  return Replay.read();
+}
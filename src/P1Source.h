@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2025 Jean-Pierre Sneyers
+ * Source : https://github.com/narfight/P1-wifi-gateway
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additionally, please note that the original source code of this file
+ * may contain portions of code derived from (or inspired by)
+ * previous works by:
+ *
+ * Ronald Leenes (https://github.com/romix123/P1-wifi-gateway and http://esp8266thingies.nl)
+ */
+
+
+#ifndef P1SOURCE_H
+#define P1SOURCE_H
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include "GlobalVar.h"
+
+#define P1RXBUFFERSIZE 1536 // UART RX ring buffer, more than a DSMR 5 datagram (read by each loop())
+#define P1REPLAYPERIOD 1000 // ms between two datagrams of a replay at speed 1 (DSMR 5 meter)
+
+/// @brief Where the bytes of the datagrams come from : the P1 port of the meter or a replay
+class P1Source
+{
+public:
+  virtual ~P1Source() = default;
+
+  /// @brief Switch the Data Request of the meter. When it goes off, the datagram already
+  /// started is still sent completely.
+  virtual void Request(bool on) = 0;
+  /// @brief Bytes that can be read now without waiting
+  virtual int available() = 0;
+  /// @brief Next byte, -1 if there is none
+  virtual int read() = 0;
+  /// @brief true if bytes were lost since the previous call
+  virtual bool hasOverrun() { return false; }
+
+  /// @brief Drop the bytes already received
+  void flush()
+  {
+    while (available() > 0) {
+      read();
+    }
+  }
+};
+
+/// @brief The P1 port : UART (inverted RX) with the Data Request (DR) and buffer enable (OE) pins
+class P1UartSource : public P1Source
+{
+public:
+  void begin();
+  void Request(bool on) override;
+  int available() override { return Serial.available(); }
+  int read() override { return Serial.read(); }
+  bool hasOverrun() override { return Serial.hasOverrun(); }
+};
+
+/// @brief Replay of datagrams recorded in a LittleFS file, one after the other like a meter would send them
+class P1FileSource : public P1Source
+{
+public:
+  /// @brief Start the replay of a file
+  /// @param path File with the raw datagrams
+  /// @param speed 1 = one datagram per P1REPLAYPERIOD, 100 = 100 times faster, 0 = as fast as possible
+  /// @return false if the file can't be opened
+  bool Open(const char *path, uint16_t speed);
+  void Close();
+  bool IsOpen() { return Opened; }
+  uint32_t Replayed = 0; // datagrams given since Open()
+
+  void Request(bool on) override { Requested = on; }
+  int available() override;
+  int read() override;
+
+private:
+  File Replay;
+  bool Opened = false;
+  bool Requested = false;
+  uint16_t Speed = 1;
+  size_t DatagramLeft = 0;       // bytes of the current datagram not read yet
+  unsigned long NextDatagram = 0; // replay clock : millis() of the next datagram
+  size_t FindDatagramEnd();
+};
+#endif
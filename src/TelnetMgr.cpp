@@ -133,7 +133,15 @@ void TelnetMgr::processCommand(int clientId, const String &command)
     commandeHelp(clientId);
   }
   else if (command == "raw") {
-    telnetClients[clientId].println(P1Captor.datagram);
+    P1Span raw = P1Captor.GetRawDatagram();
+    telnetClients[clientId].write(raw.ptr, raw.len);
+    telnetClients[clientId].println();
+  }
+  else if (command == "stats") {
+    commandeStats(clientId);
+  }
+  else if (command.startsWith("replay ")) {
+    commandeReplay(clientId, command.substring(7));
   }
   else if (command == "read") {
     P1Captor.ResetnextUpdateTime();
@@ -149,7 +157,39 @@ void TelnetMgr::processCommand(int clientId, const String &command)
 
 void TelnetMgr::commandeHelp(int clientId)
 {
-  telnetClients[clientId].println("Available commands: exit, raw, read, reboot, help");
+  telnetClients[clientId].println("Available commands: exit, raw, read, stats, replay <file> [speed] | replay stop, reboot, help");
+}
+
+void TelnetMgr::commandeStats(int clientId)
+{
+  telnetClients[clientId].printf("Datagrams : %u accepted, %u rejected\n", P1Captor.FramesAccepted, P1Captor.FramesRejected);
+  telnetClients[clientId].printf("UART : %u/%u bytes max waiting, %u overrun\n", P1Captor.RxHighWater, P1RXBUFFERSIZE, P1Captor.RxOverruns);
+
+  telnetClients[clientId].printf("Rate : %u datagrams/min, %u bytes/s during the last minute (%u bytes read)\n", P1Captor.FramesPerMin, P1Captor.BytesPerSec, P1Captor.RxBytes);
+  telnetClients[clientId].printf("Decoding : %u us for the last datagram, %u us for the slowest line\n", P1Captor.DecodeTime, P1Captor.LineTimeMax);
+  telnetClients[clientId].printf("Line order : %u predicted, %u looked up\n", P1Captor.TemplateHits, P1Captor.TemplateMisses);
+}
+
+/// @brief Replay the datagrams of a LittleFS file : "replay /day.txt 100" (speed 0 = as fast as possible)
+void TelnetMgr::commandeReplay(int clientId, String args)
+{
+  args.trim();
+  if (args == "stop") {
+    P1Captor.StopReplay();
+    telnetClients[clientId].println("Done");
+    return;
+  }
+
+  int space = args.indexOf(' ');
+  String path = (space < 0) ? args : args.substring(0, space);
+  uint16_t speed = (space < 0) ? 1 : args.substring(space + 1).toInt();
+
+  if (P1Captor.StartReplay(path.c_str(), speed)) {
+    telnetClients[clientId].printf("Replay of %s at speed %u\n", path.c_str(), speed);
+  }
+  else {
+    telnetClients[clientId].printf("Can't open %s\n", path.c_str());
+  }
 }
 
 void TelnetMgr::DoMe()
@@ -236,35 +276,35 @@ void TelnetMgr::SendDataGram()
     }
   }
 
-  int len = P1Captor.datagram.length();
+  P1Span raw = P1Captor.GetRawDatagram();
 
   for (int i = 0; i < MAX_SRV_CLIENTS; i++) {
     if (telnetClients[i].availableForWrite() >= 1) {
-      telnetClients[i].write(P1Captor.datagram.c_str(), len);
+      telnetClients[i].write(raw.ptr, raw.len);
     }
   }  
   yield();
 }
 
-void TelnetMgr::SendDebug(String payload)
+void TelnetMgr::SendDebug(const char *payload)
 {
   if (!conf.debugToTelnet) {
     return;
   }
 
-  // Calculate the required size for the buffer
-  // +3 for: 2 spaces and the null character '\0'
-  size_t totalLength = strlen("[DEBUG]") + payload.length() + 3;
-    
-  char* result = new char[totalLength];
-    
-  // Format string
-  snprintf(result, totalLength, "%s %s", "[DEBUG]", payload.c_str());
+  char line[DEBUGLINESIZE + 10]; // "[DEBUG] " + payload + "\r\n"
+  int length = snprintf(line, sizeof(line), "[DEBUG] %s\r\n", payload);
+  if (length < 0) {
+    return;
+  }
+  if ((size_t)length >= sizeof(line)) {
+    length = sizeof(line) - 1;
+  }
 
   for (int i = 0; i < MAX_SRV_CLIENTS; i++) {
     if (telnetClients[i]) {
       if (telnetClients[i].availableForWrite() > 0) {
-        telnetClients[i].println(result);
+        telnetClients[i].write(reinterpret_cast<const uint8_t *>(line), length);
       }
     }
   }
@@ -53,12 +53,14 @@ class TelnetMgr
   void handleClientActivity();
   void processCommand(int clientId, const String &command);
   void commandeHelp(int clientId);
+  void commandeStats(int clientId);
+  void commandeReplay(int clientId, String args);
   void closeConnection(int clientId);
   public:
   explicit TelnetMgr(settings& currentConf, P1Reader &currentP1);
   void DoMe();
   void stop();
   void SendDataGram();
-  void SendDebug(String payload);
+  void SendDebug(const char *payload);
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2025 Jean-Pierre Sneyers
+ * Source : https://github.com/narfight/P1-wifi-gateway
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additionally, please note that the original source code of this file
+ * may contain portions of code derived from (or inspired by)
+ * previous works by:
+ *
+ * Ronald Leenes (https://github.com/romix123/P1-wifi-gateway and http://esp8266thingies.nl)
+ */
+
+// libFuzzer target on the P1 decoder : the input is what the UART receives. The CRC after the
+// first '!' is written again to match the datagram, so the accepted datagrams are fuzzed too.
+//
+// Built with -DFUZZ_REPLAY, the target gets a main() that gives it the files of its command
+// line (a corpus, a crash) without libFuzzer. For each valid telegram, it also checks that the
+// datagram cut right after its '!' is rejected once the meter is known to send a CRC.
+
+#include <fstream>
+#include <iterator>
+#include <string>
+#include "HostMain.h"
+#include "P1Reader.h"
+
+static uint16_t CRC16(const uint8_t *data, size_t len)
+{
+  uint16_t crc = 0;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= data[i];
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc & 1) ? ((crc >> 1) ^ 0xA001) : (crc >> 1);
+    }
+  }
+  return crc;
+}
+
+/// @brief Write the CRC of the datagram started by the first '/' after the '!' that ends it
+static void FixCRC(std::vector<uint8_t> &input)
+{
+  auto start = std::find(input.begin(), input.end(), '/');
+  auto end = std::find(start, input.end(), '!');
+  if ((end == input.end()) || (input.end() - end < 5)) {
+    return;
+  }
+
+  char crc[5];
+  snprintf(crc, sizeof(crc), "%04X", CRC16(&*start, end - start + 1));
+  memcpy(&*(end + 1), crc, 4);
+}
+
+static settings &FuzzSettings()
+{
+  static settings conf = [] {
+    settings fresh{};
+    fresh.ContinuousRead = true;
+    fresh.interval = 1;
+    return fresh;
+  }();
+  return conf;
+}
+
+static void Decode(P1Reader &reader, const std::vector<uint8_t> &input)
+{
+  Serial.feed(reinterpret_cast<const char *>(input.data()), input.size());
+  while (Serial.available() > 0) {
+    reader.DoMe();
+  }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  std::vector<uint8_t> input(data, data + size);
+  FixCRC(input);
+
+  P1Reader reader(FuzzSettings());
+  HostClockOffset += 6000; // the first Data Request waits 5s after the start
+  reader.DoMe();
+
+  Decode(reader, input);
+  return 0;
+}
+
+#ifdef FUZZ_REPLAY
+/// @brief Major DSMR version given by the telegram (1-3:0.2.8 or 0-0:96.1.4), 0 if none
+static uint8_t TelegramVersion(const std::string &text)
+{
+  for (const char *id : {"\n1-3:0.2.8(", "\n0-0:96.1.4("}) {
+    size_t at = text.find(id);
+    if ((at != std::string::npos) && isDigit(text[at + strlen(id)])) {
+      return text[at + strlen(id)] - '0';
+    }
+  }
+  return 0;
+}
+
+/// @brief The telegram with its version lines removed and its CRC written again
+static std::vector<uint8_t> WithoutVersion(const std::string &text)
+{
+  std::string result;
+  size_t start = 0;
+  while (start < text.size()) {
+    size_t end = text.find('\n', start);
+    end = (end == std::string::npos) ? text.size() : end + 1;
+    if ((text.compare(start, 10, "1-3:0.2.8(") != 0) && (text.compare(start, 11, "0-0:96.1.4(") != 0)) {
+      result.append(text, start, end - start);
+    }
+    start = end;
+  }
+  std::vector<uint8_t> input(result.begin(), result.end());
+  FixCRC(input);
+  return input;
+}
+
+/// @brief The datagram cut right after its '!', as when the line is lost before the CRC
+static std::vector<uint8_t> CutAfterEnd(const std::vector<uint8_t> &input)
+{
+  std::vector<uint8_t> cut(input.begin(), std::find(input.begin(), input.end(), '!'));
+  cut.insert(cut.end(), {'!', '\r', '\n'});
+  return cut;
+}
+
+/// @brief Feed the datagrams to a new reader
+/// @return Datagrams accepted
+static uint32_t Accepted(std::initializer_list<std::vector<uint8_t>> datagrams)
+{
+  P1Reader reader(FuzzSettings());
+  HostClockOffset += 6000;
+  reader.DoMe();
+  for (const std::vector<uint8_t> &datagram : datagrams) {
+    Decode(reader, datagram);
+  }
+  return reader.FramesAccepted;
+}
+
+/// @brief A datagram without CRC passes only from a meter that doesn't send one (DSMR < 4, no CRC since boot)
+/// @return false if a cut datagram is accepted or a DSMR 2.2/3 one is rejected
+static bool CheckMissingCRC(const std::vector<uint8_t> &input)
+{
+  std::string text(input.begin(), input.end());
+  if ((text.find('!') == std::string::npos) || (Accepted({input}) != 1)) {
+    return true; // not a valid telegram, nothing to check
+  }
+
+  std::vector<uint8_t> old = WithoutVersion(text);
+  bool ok = true;
+  if ((TelegramVersion(text) >= 4) && (Accepted({CutAfterEnd(input)}) != 0)) {
+    printf("  FAILED : cut datagram of a DSMR %u meter accepted\n", TelegramVersion(text));
+    ok = false;
+  }
+  if (Accepted({old, CutAfterEnd(old)}) != 1) {
+    printf("  FAILED : cut datagram accepted after a datagram with a CRC\n");
+    ok = false;
+  }
+  if (Accepted({CutAfterEnd(old)}) != 1) {
+    printf("  FAILED : datagram without CRC nor version rejected\n");
+    ok = false;
+  }
+  return ok;
+}
+
+int main(int argc, char *argv[])
+{
+  int result = 0;
+  for (int i = 1; i < argc; i++) {
+    std::ifstream file(argv[i], std::ios::binary);
+    std::vector<uint8_t> input((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    LLVMFuzzerTestOneInput(input.data(), input.size());
+    printf("%s : %zu bytes\n", argv[i], input.size());
+    if (!CheckMissingCRC(input)) {
+      result = 1;
+    }
+  }
+  return result;
+}
+#endif
+
@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2025 Jean-Pierre Sneyers
+ * Source : https://github.com/narfight/P1-wifi-gateway
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additionally, please note that the original source code of this file
+ * may contain portions of code derived from (or inspired by)
+ * previous works by:
+ *
+ * Ronald Leenes (https://github.com/romix123/P1-wifi-gateway and http://esp8266thingies.nl)
+ */
+
+// Host benchmark of the P1 decoder : every telegram given is split by OBISTokenizer alone, then
+// decoded again and again as a meter in continuous mode would send it, then published on MQTT
+// one topic per value. The run fails if a datagram is rejected or if one of these steps takes
+// the heap.
+//
+//   p1bench [-n rounds] [-v] [telegram files or directories, test/telegrams by default]
+
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include "HostMain.h"
+#include "P1Reader.h"
+#include "MQTT.h"
+
+#define BENCHROUNDS 2000 // datagrams decoded for each telegram file
+
+static bool ReadTelegram(const std::string &path, std::string &telegram)
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  telegram.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  return !telegram.empty();
+}
+
+/// @brief Split every line of a telegram in its OBIS reference and its groups, rounds times
+/// @return false if the tokenizer allocates
+static bool BenchTokenizer(const std::string &path, const std::string &telegram, uint32_t rounds)
+{
+  uint32_t lines = 0;
+  uint32_t groups = 0;
+  size_t checksum = 0; // the spans are used, so the loop is not optimized away
+
+  HostAllocations = 0;
+  HostCountAllocations = true;
+  unsigned long start = micros();
+  for (uint32_t i = 0; i < rounds; i++) {
+    const char *line = telegram.data();
+    const char *end = line + telegram.size();
+    while (line < end) {
+      const char *eol = static_cast<const char *>(memchr(line, '\n', end - line));
+      uint16_t len = (eol == nullptr) ? (end - line) : (eol - line + 1);
+
+      OBISTokenizer tokenizer;
+      OBISGroup group;
+      if (tokenizer.begin(line, len)) {
+        checksum += tokenizer.id.len;
+        while (tokenizer.next(group)) {
+          checksum += group.value.len + group.unit.len;
+          groups++;
+        }
+      }
+      lines++;
+      line += len;
+    }
+  }
+  unsigned long spent = micros() - start;
+  HostCountAllocations = false;
+
+  if (spent == 0) {
+    spent = 1;
+  }
+  printf("%-24s %12.0f %10.2f %8u %8.3f %12zu\n", std::filesystem::path(path).filename().c_str(),
+    lines * 1000000.0 / spent, rounds * telegram.size() / (double)spent, groups / rounds,
+    (double)HostAllocations / rounds, checksum / rounds);
+
+  if (HostAllocations != 0) {
+    printf("  FAILED : %u allocations while splitting the lines\n", HostAllocations);
+    return false;
+  }
+  return true;
+}
+
+/// @brief Give a datagram to the decoder the way the UART would, all its bytes already received
+static void Decode(P1Reader &reader, const std::string &telegram)
+{
+  Serial.feed(telegram.data(), telegram.size());
+  while (Serial.available() > 0) {
+    reader.DoMe();
+  }
+}
+
+/// @brief Decode a telegram rounds times and print one line of results
+/// @return false if a datagram is rejected or if the decoding allocates
+static bool BenchDecoder(const std::string &path, const std::string &telegram, uint32_t rounds)
+{
+  settings conf{};
+  conf.ContinuousRead = true;
+  conf.interval = 1;
+
+  P1Reader reader(conf);
+  HostClockOffset += 6000; // the first Data Request waits 5s after the start
+  reader.DoMe();
+
+  Decode(reader, telegram); // learns the order of the lines and the name of the meter
+  reader.LineTimeMax = 0;
+
+  HostAllocations = 0;
+  HostCountAllocations = true;
+  unsigned long start = micros();
+  for (uint32_t i = 0; i < rounds; i++) {
+    Decode(reader, telegram);
+  }
+  unsigned long spent = micros() - start;
+  HostCountAllocations = false;
+
+  if (spent == 0) {
+    spent = 1;
+  }
+  double perSecond = rounds * 1000000.0 / spent;
+  printf("%-24s %-26s %6zu %12.0f %10.2f %8.3f %8u\n",
+    std::filesystem::path(path).filename().c_str(), reader.meterName.c_str(), telegram.size(),
+    perSecond, perSecond * telegram.size() / 1e6, (double)HostAllocations / rounds, reader.LineTimeMax);
+
+  bool ok = true;
+  if ((reader.FramesRejected != 0) || (reader.FramesAccepted != rounds + 1)) {
+    printf("  FAILED : %u datagrams accepted, %u rejected for %u sent\n", reader.FramesAccepted, reader.FramesRejected, rounds + 1);
+    ok = false;
+  }
+  if (HostAllocations != 0) {
+    printf("  FAILED : %u allocations while decoding\n", HostAllocations);
+    ok = false;
+  }
+  return ok;
+}
+
+/// @brief Decode and publish a telegram rounds times, MQTT_reporter() being called for each datagram
+/// @return false if a report allocates
+static bool BenchReport(const std::string &path, const std::string &telegram, uint32_t rounds)
+{
+  settings conf{};
+  conf.ContinuousRead = true;
+  conf.interval = 1;
+  conf.mqtt = true;
+  conf.mqttInterval = 0; // every datagram
+  conf.fullRefresh = 0;  // every value
+  strcpy(conf.mqttTopic, "dsmr");
+
+  P1Reader reader(conf);
+  WifiMgr wifi(conf);
+  MQTTMgr mqtt(conf, wifi, reader);
+  HostClockOffset += 6000;
+  reader.DoMe();
+
+  Decode(reader, telegram); // topics of the M-Bus devices, name of the meter
+  uint32_t published = HostMqttPublished;
+  uint32_t bytes = HostMqttPublishedBytes;
+
+  HostAllocations = 0;
+  HostCountAllocations = true;
+  for (uint32_t i = 0; i < rounds; i++) {
+    Decode(reader, telegram);
+  }
+  HostCountAllocations = false;
+
+  printf("%-24s %12.1f %12.1f %8.3f\n", std::filesystem::path(path).filename().c_str(),
+    (double)(HostMqttPublished - published) / rounds, (double)(HostMqttPublishedBytes - bytes) / rounds,
+    (double)HostAllocations / rounds);
+
+  if (HostAllocations != 0) {
+    printf("  FAILED : %u allocations while reporting\n", HostAllocations);
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  uint32_t rounds = BENCHROUNDS;
+  std::vector<std::string> paths;
+
+  for (int i = 1; i < argc; i++) {
+    if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc)) {
+      rounds = strtoul(argv[++i], nullptr, 10);
+    }
+    else if (strcmp(argv[i], "-v") == 0) {
+      HostVerbose = true;
+    }
+    else if (std::filesystem::is_directory(argv[i])) {
+      for (const auto &entry : std::filesystem::directory_iterator(argv[i])) {
+        paths.push_back(entry.path().string());
+      }
+    }
+    else {
+      paths.push_back(argv[i]);
+    }
+  }
+  if (paths.empty()) {
+    for (const auto &entry : std::filesystem::directory_iterator("test/telegrams")) {
+      paths.push_back(entry.path().string());
+    }
+  }
+  std::sort(paths.begin(), paths.end());
+
+  bool ok = true;
+  std::vector<std::string> telegrams(paths.size());
+  printf("%-24s %-26s %6s %12s %10s %8s %8s\n", "telegram", "meter", "bytes", "datagrams/s", "MB/s", "alloc/dg", "line us");
+  for (size_t i = 0; i < paths.size(); i++) {
+    if (!ReadTelegram(paths[i], telegrams[i])) {
+      printf("%s : can't read it\n", paths[i].c_str());
+      ok = false;
+      continue;
+    }
+    ok &= BenchDecoder(paths[i], telegrams[i], rounds);
+  }
+
+  printf("\n%-24s %12s %10s %8s %8s %12s\n", "OBISTokenizer", "lines/s", "MB/s", "groups", "alloc", "checksum");
+  for (size_t i = 0; i < paths.size(); i++) {
+    if (!telegrams[i].empty()) {
+      ok &= BenchTokenizer(paths[i], telegrams[i], rounds);
+    }
+  }
+
+  printf("\n%-24s %12s %12s %8s\n", "MQTT report", "publishes", "bytes", "alloc");
+  for (size_t i = 0; i < paths.size(); i++) {
+    if (!telegrams[i].empty()) {
+      ok &= BenchReport(paths[i], telegrams[i], rounds);
+    }
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2025 Jean-Pierre Sneyers
+ * Source : https://github.com/narfight/P1-wifi-gateway
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additionally, please note that the original source code of this file
+ * may contain portions of code derived from (or inspired by)
+ * previous works by:
+ *
+ * Ronald Leenes (https://github.com/romix123/P1-wifi-gateway and http://esp8266thingies.nl)
+ */
+
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+// Arduino core of the host build (test/) : just what the P1 decoder and the MQTT reports use.
+// The clock is the one of the host, Serial gives the bytes of a buffer, the pins do nothing.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+typedef uint8_t byte;
+using std::min;
+using std::max;
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define F(s) (s)
+#define snprintf_P snprintf
+#define strcpy_P strcpy
+#define strlen_P strlen
+#define memcpy_P memcpy
+#define pgm_read_byte(addr) (*reinterpret_cast<const uint8_t *>(addr))
+#define pgm_read_word(addr) (*reinterpret_cast<const uint16_t *>(addr))
+#define pgm_read_dword(addr) (*reinterpret_cast<const uint32_t *>(addr))
+
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define SERIAL_8N1 0x1c
+#define SERIAL_FULL 0
+
+inline unsigned long HostClockOffset = 0; // ms added to the clock of the host, to skip the waits of the firmware
+
+inline unsigned long micros()
+{
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::microseconds>(now).count() + HostClockOffset * 1000UL;
+}
+
+inline unsigned long millis()
+{
+  return micros() / 1000;
+}
+
+inline void delay(unsigned long) {}
+inline void yield() {}
+inline void pinMode(uint8_t, uint8_t) {}
+inline void digitalWrite(uint8_t, uint8_t) {}
+inline int digitalRead(uint8_t) { return LOW; }
+
+inline bool isDigit(int c) { return isdigit(c) != 0; }
+inline bool isHexadecimalDigit(int c) { return isxdigit(c) != 0; }
+
+/// @brief Arduino String on a std::string, with what ArduinoJson needs to write in it
+class String
+{
+public:
+  String() = default;
+  String(const char *text) { if (text != nullptr) { Text = text; } }
+  String &operator=(const char *text)
+  {
+    if (text == nullptr) {
+      Text.clear();
+    }
+    else {
+      Text = text;
+    }
+    return *this;
+  }
+  const char *c_str() const { return Text.c_str(); }
+  unsigned int length() const { return Text.length(); }
+  bool concat(const char *text) { Text += text; return true; }
+  bool concat(const char *text, unsigned int len) { Text.append(text, len); return true; }
+  bool concat(char c) { Text += c; return true; }
+  int indexOf(const char *text) const
+  {
+    size_t pos = Text.find(text);
+    return (pos == std::string::npos) ? -1 : (int)pos;
+  }
+  bool operator==(const char *text) const { return Text == text; }
+  bool operator!=(const char *text) const { return Text != text; }
+
+private:
+  std::string Text;
+};
+
+class StringSumHelper : public String
+{
+};
+
+/// @brief UART of the P1 port : gives the bytes of the buffer set by feed(), without copying them
+class HostSerial
+{
+public:
+  void begin(unsigned long) {}
+  void begin(unsigned long, int, int, int, bool) {}
+  size_t setRxBufferSize(size_t size) { return size; }
+  void feed(const char *data, size_t len)
+  {
+    Data = data;
+    Length = len;
+    Pos = 0;
+  }
+  int available() { return Length - Pos; }
+  int read() { return (Pos < Length) ? (uint8_t)Data[Pos++] : -1; }
+  bool hasOverrun() { return false; }
+  void flush() {}
+  size_t println(const char *text) { return fprintf(stderr, "%s\n", text); }
+
+private:
+  const char *Data = nullptr;
+  size_t Length = 0;
+  size_t Pos = 0;
+};
+
+inline HostSerial Serial;
+
+#endif
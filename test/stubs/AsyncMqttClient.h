@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2025 Jean-Pierre Sneyers
+ * Source : https://github.com/narfight/P1-wifi-gateway
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additionally, please note that the original source code of this file
+ * may contain portions of code derived from (or inspired by)
+ * previous works by:
+ *
+ * Ronald Leenes (https://github.com/romix123/P1-wifi-gateway and http://esp8266thingies.nl)
+ */
+
+#ifndef HOST_ASYNCMQTTCLIENT_H
+#define HOST_ASYNCMQTTCLIENT_H
+
+// MQTT client of the host build : nothing is sent, the publications are only counted
+
+#include <Arduino.h>
+
+inline uint32_t HostMqttPublished = 0;      // messages given to publish() while connected
+inline uint32_t HostMqttPublishedBytes = 0; // bytes of their payloads
+
+enum class AsyncMqttClientDisconnectReason : uint8_t {
+  TCP_DISCONNECTED = 0
+};
+
+struct AsyncMqttClientMessageProperties
+{
+  uint8_t qos;
+  bool dup;
+  bool retain;
+};
+
+class AsyncMqttClient
+{
+public:
+  typedef std::function<void(bool sessionPresent)> OnConnectUserCallback;
+  typedef std::function<void(AsyncMqttClientDisconnectReason reason)> OnDisconnectUserCallback;
+  typedef std::function<void(uint16_t packetId)> OnPublishUserCallback;
+  typedef std::function<void(char *topic, char *payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total)> OnMessageUserCallback;
+
+  AsyncMqttClient &onConnect(OnConnectUserCallback callback) { ConnectCallback = callback; return *this; }
+  AsyncMqttClient &onDisconnect(OnDisconnectUserCallback callback) { DisconnectCallback = callback; return *this; }
+  AsyncMqttClient &onPublish(OnPublishUserCallback callback) { PublishCallback = callback; return *this; }
+  AsyncMqttClient &onMessage(OnMessageUserCallback callback) { MessageCallback = callback; return *this; }
+  AsyncMqttClient &setCredentials(const char *, const char * = nullptr) { return *this; }
+  AsyncMqttClient &setServer(const char *, uint16_t) { return *this; }
+  AsyncMqttClient &setClientId(const char *) { return *this; }
+  AsyncMqttClient &setWill(const char *, uint8_t, bool, const char * = nullptr, size_t = 0) { return *this; }
+
+  void connect() { Connected = true; }
+  void disconnect(bool = false) { Connected = false; }
+  bool connected() const { return Connected; }
+  void clearQueue() {}
+  uint16_t subscribe(const char *, uint8_t) { return ++PacketId; }
+  uint16_t publish(const char *, uint8_t, bool, const char *payload = nullptr, size_t length = 0, bool = false, uint16_t = 0)
+  {
+    if (!Connected) {
+      return 0;
+    }
+    HostMqttPublished++;
+    HostMqttPublishedBytes += (payload == nullptr) ? 0 : ((length != 0) ? length : strlen(payload));
+    return ++PacketId;
+  }
+
+private:
+  bool Connected = false;
+  OnConnectUserCallback ConnectCallback;
+  OnDisconnectUserCallback DisconnectCallback;
+  OnPublishUserCallback PublishCallback;
+  OnMessageUserCallback MessageCallback;
+  uint16_t PacketId = 0;
+};
+
+#endif
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2025 Jean-Pierre Sneyers
+ * Source : https://github.com/narfight/P1-wifi-gateway
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additionally, please note that the original source code of this file
+ * may contain portions of code derived from (or inspired by)
+ * previous works by:
+ *
+ * Ronald Leenes (https://github.com/romix123/P1-wifi-gateway and http://esp8266thingies.nl)
+ */
+
+#ifndef HOST_MAIN_H
+#define HOST_MAIN_H
+
+// What Main.cpp and WifiMgr.cpp give to the other modules on the device. To be included
+// once, by the file of the host program that has main() : it also replaces operator new
+// to count the allocations.
+
+#include <new>
+#include "Debug.h"
+#include "WifiMgr.h"
+
+bool HostVerbose = false;            // debug lines on stderr
+bool HostCountAllocations = false;   // HostAllocations is only counted while it is set
+uint32_t HostAllocations = 0;
+
+void *operator new(size_t size)
+{
+  if (HostCountAllocations) {
+    HostAllocations++;
+  }
+  void *ptr = malloc((size != 0) ? size : 1);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void *operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete[](void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { free(ptr); }
+
+void MainSendDebug(const char *payload)
+{
+  if (HostVerbose) {
+    fprintf(stderr, "%s\n", payload);
+  }
+}
+
+void MainSendDebugPrintf(const char *format, ...)
+{
+  char buffer[DEBUGLINESIZE];
+  va_list args;
+
+  va_start(args, format);
+  vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  MainSendDebug(buffer);
+}
+
+void blink(int, unsigned long) {}
+void Yield_Delay(unsigned long) {}
+void RequestRestart(unsigned long) {}
+
+char *GetClientName()
+{
+  static char name[] = "P1meter-host";
+  return name;
+}
+
+WifiMgr::WifiMgr(settings &currentConf) : conf(currentConf) {}
+String WifiMgr::CurrentIP() { return "127.0.0.1"; }
+void WifiMgr::OnWifiEvent(std::function<void(bool, wl_status_t, wl_status_t)> CallBack) { DelegateWifiChange = CallBack; }
+
+#endif
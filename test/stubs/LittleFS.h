@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2025 Jean-Pierre Sneyers
+ * Source : https://github.com/narfight/P1-wifi-gateway
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additionally, please note that the original source code of this file
+ * may contain portions of code derived from (or inspired by)
+ * previous works by:
+ *
+ * Ronald Leenes (https://github.com/romix123/P1-wifi-gateway and http://esp8266thingies.nl)
+ */
+
+#ifndef HOST_LITTLEFS_H
+#define HOST_LITTLEFS_H
+
+// LittleFS of the host build : the files are kept in memory, the modes are the ones of LittleFS (r, r+, w, a)
+
+#include <Arduino.h>
+#include <map>
+
+class File
+{
+public:
+  File() = default;
+  File(std::string *data, bool append) : Data(data), Append(append), Pos(append ? data->size() : 0) {}
+  explicit operator bool() const { return Data != nullptr; }
+  void close() { Data = nullptr; }
+  size_t size() const { return Data->size(); }
+  size_t position() const { return Pos; }
+  bool seek(uint32_t pos)
+  {
+    Pos = std::min<size_t>(pos, Data->size());
+    return true;
+  }
+  int read() { return (Pos < Data->size()) ? (uint8_t)(*Data)[Pos++] : -1; }
+  size_t read(uint8_t *buf, size_t len)
+  {
+    len = std::min(len, Data->size() - Pos);
+    memcpy(buf, Data->data() + Pos, len);
+    Pos += len;
+    return len;
+  }
+  size_t write(const uint8_t *buf, size_t len)
+  {
+    if (Append) {
+      Pos = Data->size();
+    }
+    if (Data->size() < Pos + len) {
+      Data->resize(Pos + len);
+    }
+    memcpy(&(*Data)[Pos], buf, len);
+    Pos += len;
+    return len;
+  }
+
+private:
+  std::string *Data = nullptr;
+  bool Append = false;
+  size_t Pos = 0;
+};
+
+class HostFS
+{
+public:
+  bool begin() { return true; }
+  File open(const char *path, const char *mode)
+  {
+    auto file = Files.find(path);
+    if (mode[0] == 'r') {
+      return (file == Files.end()) ? File() : File(&file->second, false);
+    }
+    std::string &data = Files[path];
+    if (mode[0] == 'w') {
+      data.clear();
+    }
+    return File(&data, mode[0] == 'a');
+  }
+  bool exists(const char *path) { return Files.count(path) != 0; }
+  bool remove(const char *path) { return Files.erase(path) != 0; }
+
+  std::map<std::string, std::string> Files; // path -> content
+};
+
+inline HostFS LittleFS;
+
+#endif